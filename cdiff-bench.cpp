@@ -0,0 +1,307 @@
+// cdiff-bench: generates synthetic file pairs and times `cdiff diff` with
+// each engine, then `cdiff patch` with every patch that came out, printing
+// one JSON object per run to stdout:
+//
+//   {"lines":100000,"density":0.01,"line_length":40,"moves":0,
+//    "engine":"myers","op":"diff","seconds":0.041,"lines_per_s":4.8e+06,
+//    "mb_per_s":197.3,"peak_rss_kb":14236,"output_bytes":61720,"ok":true}
+//
+// Every run is a child process, so peak_rss_kb is that run's alone. Build
+// next to cdiff with g++ -std=c++17 -O2 -o cdiff-bench cdiff-bench.cpp.
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// The shape of one synthetic file pair.
+struct Workload {
+  int lines = 100000;     // in the source
+  double density = 0.01;  // chance that a line is removed, added or changed
+  int line_length = 40;   // average, in bytes
+  int moves = 0;          // blocks cut out and pasted elsewhere
+  int move_size = 20;     // lines per moved block
+};
+
+// Source lines are random words; the target takes every line through an
+// edit with probability `density` and then moves `moves` blocks around.
+void generate(const Workload& workload, uint64_t seed,
+              std::vector<std::string>& src, std::vector<std::string>& dst) {
+  std::mt19937_64 random(seed);
+  auto line = [&]() {
+    int size = workload.line_length / 2 +
+               random() % (workload.line_length + 1);
+    std::string text;
+    while (int(text.size()) < size) {
+      if (not text.empty()) text += ' ';
+      for (int k = 1 + random() % 8; k > 0; --k) text += 'a' + random() % 26;
+    }
+    return text;
+  };
+  std::uniform_real_distribution<double> chance(0, 1);
+
+  src.clear();
+  dst.clear();
+  for (int i = 0; i < workload.lines; ++i) src.push_back(line());
+  for (const auto& text : src) {
+    if (chance(random) >= workload.density) {
+      dst.push_back(text);
+      continue;
+    }
+    switch (random() % 3) {
+      case 0:  // removed
+        break;
+      case 1:  // added before
+        dst.push_back(line());
+        dst.push_back(text);
+        break;
+      case 2:  // changed
+        dst.push_back(line());
+        break;
+    }
+  }
+
+  for (int k = 0; k < workload.moves and int(dst.size()) > workload.move_size;
+       ++k) {
+    size_t from = random() % (dst.size() - workload.move_size + 1);
+    std::vector<std::string> block(dst.begin() + from,
+                                   dst.begin() + from + workload.move_size);
+    dst.erase(dst.begin() + from, dst.begin() + from + workload.move_size);
+    size_t to = random() % (dst.size() + 1);
+    dst.insert(dst.begin() + to, block.begin(), block.end());
+  }
+}
+
+uint64_t write_lines(const std::string& path,
+                     const std::vector<std::string>& lines) {
+  std::ofstream file(path, std::ios::binary);
+  uint64_t size = 0;
+  for (const auto& line : lines) {
+    file << line << '\n';
+    size += line.size() + 1;
+  }
+  if (not file) {
+    std::cout << "Error: writing the file " << path << std::endl;
+    exit(1);
+  }
+  return size;
+}
+
+struct Run {
+  double seconds = 0;
+  long peak_rss_kb = 0;
+  int status = -1;
+};
+
+// Runs `args` in `dir` with stdout going to `output`, and measures it.
+Run run_child(const std::string& dir, const std::vector<std::string>& args,
+              const std::string& output) {
+  Run run;
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) return run;
+  if (pid == 0) {
+    int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 or chdir(dir.c_str()) < 0) _exit(127);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+      argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) return run;
+  run.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  run.peak_rss_kb = usage.ru_maxrss;
+  run.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  return run;
+}
+
+bool same_file(const std::string& path1, const std::string& path2) {
+  std::ifstream file1(path1, std::ios::binary), file2(path2, std::ios::binary);
+  std::stringstream contents1, contents2;
+  contents1 << file1.rdbuf();
+  contents2 << file2.rdbuf();
+  return file1 and file2 and contents1.str() == contents2.str();
+}
+
+// The `cdiff diff` options of every engine the suite knows.
+const std::vector<std::pair<std::string, std::vector<std::string>>> ENGINES = {
+    {"myers", {}},
+    {"linear", {"--linear-space"}},
+    {"bitparallel", {"--algorithm=bitparallel"}},
+    {"dp", {"--algorithm=dp"}},
+    {"patience", {"--patience"}},
+    {"auto", {"--algorithm=auto"}},
+};
+
+template <typename T>
+bool parse_list(const std::string& text, std::vector<T>& values) {
+  values.clear();
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    std::stringstream number(item);
+    T value;
+    if (not(number >> value) or not number.eof() or value < 0) return false;
+    values.push_back(value);
+  }
+  return not values.empty();
+}
+
+int main(int argc, char** argv) {
+  std::string usage =
+      std::string("Usage: ") + argv[0] +
+      " [--cdiff PATH] [--dir DIR] [--seed N] [--lines N,...] "
+      "[--density F,...] [--line-length N,...] [--moves N,...] "
+      "[--move-size N] [--engines NAME,...]\n"
+      "Times every engine (myers, linear, bitparallel, dp, patience, auto; "
+      "all but dp by default) on every combination of the listed workloads.";
+
+  std::string cdiff = "./cdiff";
+  std::string dir = std::filesystem::temp_directory_path() / "cdiff-bench";
+  uint64_t seed = 1;
+  std::vector<int> lines = {100000}, line_lengths = {40}, moves = {0};
+  std::vector<double> densities = {0.01};
+  int move_size = 20;
+  std::vector<std::string> engines = {"myers", "linear", "bitparallel",
+                                      "patience", "auto"};
+
+  std::vector<std::string> args(argv + 1, argv + argc);
+  for (size_t i = 0; i < args.size(); ++i) {
+    const std::string& arg = args[i];
+    if (i + 1 == args.size()) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: missing the value of " << arg << '\n';
+      return 1;
+    }
+    const std::string& value = args[++i];
+    bool ok = true;
+    if (arg == "--cdiff") {
+      cdiff = value;
+    } else if (arg == "--dir") {
+      dir = value;
+    } else if (arg == "--seed") {
+      ok = not value.empty() and
+           std::all_of(value.begin(), value.end(), ::isdigit);
+      if (ok) seed = std::stoull(value);
+    } else if (arg == "--lines") {
+      ok = parse_list(value, lines);
+    } else if (arg == "--density") {
+      ok = parse_list(value, densities);
+    } else if (arg == "--line-length") {
+      ok = parse_list(value, line_lengths);
+    } else if (arg == "--moves") {
+      ok = parse_list(value, moves);
+    } else if (arg == "--move-size") {
+      std::vector<int> sizes;
+      ok = parse_list(value, sizes) and sizes.size() == 1 and sizes[0] > 0;
+      if (ok) move_size = sizes[0];
+    } else if (arg == "--engines") {
+      std::stringstream stream(value);
+      std::string name;
+      engines.clear();
+      while (std::getline(stream, name, ',')) {
+        ok = ok and std::any_of(ENGINES.begin(), ENGINES.end(),
+                                [&](const auto& e) { return e.first == name; });
+        engines.push_back(name);
+      }
+    } else {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: unknown option " << arg << '\n';
+      return 1;
+    }
+    if (not ok) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: invalid value " << value << " for " << arg << '\n';
+      return 1;
+    }
+  }
+
+  cdiff = std::filesystem::absolute(cdiff);
+  if (access(cdiff.c_str(), X_OK) != 0) {
+    std::cout << "ERROR: cannot run " << cdiff << " (see --cdiff)\n";
+    return 1;
+  }
+  std::error_code error;
+  std::filesystem::create_directories(dir, error);
+  if (not std::filesystem::is_directory(dir)) {
+    std::cout << "ERROR: cannot create the directory " << dir << '\n';
+    return 1;
+  }
+
+  std::vector<std::string> src, dst;
+  for (int size : lines) {
+    for (double density : densities) {
+      for (int line_length : line_lengths) {
+        for (int move_count : moves) {
+          Workload workload = {size, density, line_length, move_count,
+                               move_size};
+          generate(workload, seed, src, dst);
+          uint64_t bytes = write_lines(dir + "/src.txt", src) +
+                           write_lines(dir + "/dst.txt", dst);
+          double total_lines = src.size() + dst.size();
+
+          auto report = [&](const std::string& engine, const std::string& op,
+                            const Run& run, uint64_t output_bytes, bool ok) {
+            double seconds = std::max(run.seconds, 1e-9);
+            std::cout << "{\"lines\":" << size << ",\"density\":" << density
+                      << ",\"line_length\":" << line_length
+                      << ",\"moves\":" << move_count << ",\"engine\":\""
+                      << engine << "\",\"op\":\"" << op
+                      << "\",\"seconds\":" << run.seconds
+                      << ",\"lines_per_s\":" << total_lines / seconds
+                      << ",\"mb_per_s\":" << bytes / seconds / 1e6
+                      << ",\"peak_rss_kb\":" << run.peak_rss_kb
+                      << ",\"output_bytes\":" << output_bytes
+                      << ",\"ok\":" << (ok ? "true" : "false") << "}"
+                      << std::endl;
+          };
+
+          for (const auto& name : engines) {
+            auto options = std::find_if(
+                ENGINES.begin(), ENGINES.end(),
+                [&](const auto& e) { return e.first == name; })->second;
+            std::vector<std::string> diff = {cdiff, "diff"};
+            diff.insert(diff.end(), options.begin(), options.end());
+            diff.insert(diff.end(), {"src.txt", "dst.txt"});
+            std::string patch = dir + "/" + name + ".patch";
+            Run run = run_child(dir, diff, patch);
+            uint64_t patch_bytes = std::filesystem::file_size(patch, error);
+            report(name, "diff", run, patch_bytes, run.status == 0);
+            if (run.status != 0) continue;
+
+            run = run_child(dir, {cdiff, "patch", "src.txt", name + ".patch"},
+                            "/dev/null");
+            bool ok = run.status == 0 and
+                      same_file(dir + "/_src.txt", dir + "/dst.txt");
+            report(name, "patch", run,
+                   std::filesystem::file_size(dir + "/_src.txt", error), ok);
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
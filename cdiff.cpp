@@ -1,195 +1,2781 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <fstream>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <iomanip>
 #include <iostream>
-#include <regex>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-std::vector<std::string> read_entire_file(const std::string& filename) {
-  std::ifstream inputFile(filename);
-  if (not inputFile.is_open()) {
+#include "libcdiff.h"
+
+#ifdef CDIFF_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CDIFF_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace cdiff;
+
+// Every byte the process has asked operator new for since --stats turned
+// counting on. Off, an allocation only reads the flag, so runs without
+// --stats do not contend on the counter. The whole family of operator new
+// and delete is replaced, every form on malloc and free, so whatever pairs
+// up in the program (or a sanitizer's checks) they match. The deletes free
+// out of line, or GCC pairs an inlined free() with the new expression and
+// warns about a mismatch.
+std::atomic<bool> count_allocations = false;
+alignas(64) std::atomic<uint64_t> allocated_bytes = 0;
+
+void* allocate(size_t size, size_t alignment = 0) {
+  if (count_allocations.load(std::memory_order_relaxed)) {
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  if (size == 0) size = 1;
+  while (true) {
+    void* p = nullptr;
+    if (alignment <= alignof(std::max_align_t)) {
+      p = malloc(size);
+    } else if (posix_memalign(&p, alignment, size) != 0) {
+      p = nullptr;
+    }
+    if (p) return p;
+    std::new_handler handler = std::get_new_handler();
+    if (not handler) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void* allocate(size_t size, size_t alignment, const std::nothrow_t&) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) {
+  return allocate(size, size_t(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return allocate(size, size_t(alignment));
+}
+void* operator new(size_t size, const std::nothrow_t& tag) noexcept {
+  return allocate(size, 0, tag);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+  return allocate(size, 0, tag);
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t& tag) noexcept {
+  return allocate(size, size_t(alignment), tag);
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t& tag) noexcept {
+  return allocate(size, size_t(alignment), tag);
+}
+
+__attribute__((noinline)) void release(void* p) noexcept { free(p); }
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, size_t) noexcept { release(p); }
+void operator delete[](void* p, size_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  release(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  release(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  release(p);
+}
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  release(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  release(p);
+}
+
+// The lines of a file, as views into the file mapped read-only into memory.
+// Line i spans [offsets[i], offsets[i + 1] - 1), the last offset accounts
+// for a missing trailing newline, so no line is ever copied.
+class LineFile {
+ public:
+  LineFile() = default;
+  // contents that are already in memory, such as those of a batch job
+  explicit LineFile(std::string bytes) : buffer(std::move(bytes)) {
+    data = buffer.data();
+    index_lines();
+  }
+  LineFile(const LineFile&) = delete;
+  LineFile& operator=(const LineFile&) = delete;
+  LineFile(LineFile&& other) { *this = std::move(other); }
+  LineFile& operator=(LineFile&& other) {
+    std::swap(mapping, other.mapping);
+    std::swap(mapping_size, other.mapping_size);
+    std::swap(buffer, other.buffer);
+    std::swap(offsets, other.offsets);
+    std::swap(data, other.data);
+    // a short buffer lives inside the string, which did not move
+    if (not mapping) data = buffer.data();
+    if (not other.mapping) other.data = other.buffer.data();
+    return *this;
+  }
+  ~LineFile() {
+    if (mapping) munmap(mapping, mapping_size);
+  }
+
+  size_t size() const { return offsets.size() - 1; }
+  std::string_view contents() const {
+    return std::string_view(data, mapping ? mapping_size : buffer.size());
+  }
+  std::string_view operator[](size_t i) const {
+    return std::string_view(data + offsets[i], offsets[i + 1] - offsets[i] - 1);
+  }
+
+  friend bool read_file(const std::string& filename, LineFile& file,
+                        std::string& error);
+  friend bool decompress_file(LineFile& file, const std::string& filename,
+                              std::string& error);
+
+ private:
+  void index_lines() {
+    const char* begin = data;
+    const char* end = begin + contents().size();
+    for (const char* p = begin; p < end;) {
+      auto newline = static_cast<const char*>(memchr(p, '\n', end - p));
+      p = newline ? newline + 1 : end + 1;
+      offsets.push_back(p - begin);
+    }
+  }
+
+  void* mapping = nullptr;
+  size_t mapping_size = 0;
+  std::string buffer;  // used instead of a mapping for pipes and the like
+  std::vector<size_t> offsets = {0};
+  const char* data = nullptr;
+};
+
+// Loads `filename` into `file`; false, with `error` set, if it cannot be
+// read.
+bool read_file(const std::string& filename, LineFile& file,
+               std::string& error) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd < 0 or fstat(fd, &info) < 0) {
+    if (fd >= 0) close(fd);
+    error = "Error: opening the file " + filename;
+    return false;
+  }
+
+  file = LineFile();
+  size_t size = 0;
+  if (S_ISREG(info.st_mode) and info.st_size > 0) {
+    size = info.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      madvise(mapping, size, MADV_SEQUENTIAL);
+      file.mapping = mapping;
+      file.mapping_size = size;
+      file.data = static_cast<const char*>(mapping);
+    }
+  }
+
+  if (not file.mapping) {
+    char chunk[1 << 16];
+    ssize_t count;
+    while ((count = read(fd, chunk, sizeof(chunk))) > 0) {
+      file.buffer.append(chunk, count);
+    }
+    if (count < 0) {
+      close(fd);
+      error = "Error: reading the file " + filename;
+      return false;
+    }
+    size = file.buffer.size();
+    file.data = file.buffer.data();
+  }
+  close(fd);
+
+  file.index_lines();
+  return true;
+}
+
+LineFile read_entire_file(const std::string& filename) {
+  LineFile file;
+  std::string error;
+  if (not read_file(filename, file, error)) {
+    std::cout << error << std::endl;
+    exit(1);
+  }
+  return file;
+}
+
+// Patches can be gzip or zstd compressed on the way out and are recognized
+// by their magic bytes on the way in. Each codec is only compiled in when
+// asked for: build with -DCDIFF_WITH_ZLIB -lz and/or -DCDIFF_WITH_ZSTD -lzstd.
+enum class Compression { NONE, GZIP, ZSTD };
+
+bool parse_compression(const std::string& name, Compression& compression) {
+  if (name == "none") {
+    compression = Compression::NONE;
+  } else if (name == "gzip") {
+    compression = Compression::GZIP;
+  } else if (name == "zstd") {
+    compression = Compression::ZSTD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+Compression detect_compression(std::string_view start) {
+  if (start.substr(0, 2) == "\x1f\x8b") return Compression::GZIP;
+  if (start.substr(0, 4) == "\x28\xb5\x2f\xfd") return Compression::ZSTD;
+  return Compression::NONE;
+}
+
+bool compression_supported(Compression compression,
+                           [[maybe_unused]] std::string& error) {
+  switch (compression) {
+    case Compression::NONE:
+      return true;
+    case Compression::GZIP:
+#ifdef CDIFF_WITH_ZLIB
+      return true;
+#else
+      error = "this build of cdiff has no gzip support";
+      return false;
+#endif
+    case Compression::ZSTD:
+#ifdef CDIFF_WITH_ZSTD
+      return true;
+#else
+      error = "this build of cdiff has no zstd support";
+      return false;
+#endif
+  }
+  return false;
+}
+
+// Compresses everything written to it into `file`. After flush() the output
+// so far can be decompressed on its own, finish() ends the stream.
+class Compressor {
+ public:
+  virtual ~Compressor() = default;
+  virtual void write(std::string_view input, FILE* file) = 0;
+  virtual void flush(FILE* file) = 0;
+  virtual void finish(FILE* file) = 0;
+};
+
+// Decompresses from `input` into [output, output + capacity), consuming
+// input and returning the number of bytes produced, or -1 on corrupt data.
+// finished() tells whether the input seen so far ends a complete stream.
+class Decompressor {
+ public:
+  virtual ~Decompressor() = default;
+  virtual long decompress(std::string_view& input, char* output,
+                          size_t capacity) = 0;
+  virtual bool finished() const = 0;
+};
+
+#ifdef CDIFF_WITH_ZLIB
+class GzipCompressor : public Compressor {
+ public:
+  GzipCompressor() : chunk(1 << 16) {
+    // 16 + MAX_WBITS asks zlib for a gzip header instead of a zlib one.
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                 Z_DEFAULT_STRATEGY);
+  }
+  ~GzipCompressor() { deflateEnd(&stream); }
+
+  void write(std::string_view input, FILE* file) override {
+    run(input, file, Z_NO_FLUSH);
+  }
+  void flush(FILE* file) override { run({}, file, Z_SYNC_FLUSH); }
+  void finish(FILE* file) override { run({}, file, Z_FINISH); }
+
+ private:
+  void run(std::string_view input, FILE* file, int mode) {
+    stream.next_in = (Bytef*)input.data();
+    stream.avail_in = input.size();
+    do {
+      stream.next_out = (Bytef*)chunk.data();
+      stream.avail_out = chunk.size();
+      deflate(&stream, mode);
+      fwrite(chunk.data(), 1, chunk.size() - stream.avail_out, file);
+    } while (stream.avail_out == 0);
+  }
+
+  z_stream stream = {};
+  std::vector<char> chunk;
+};
+
+class GzipDecompressor : public Decompressor {
+ public:
+  // 32 + MAX_WBITS accepts both gzip and zlib headers.
+  GzipDecompressor() { inflateInit2(&stream, 32 + MAX_WBITS); }
+  ~GzipDecompressor() { inflateEnd(&stream); }
+
+  long decompress(std::string_view& input, char* output,
+                  size_t capacity) override {
+    // Concatenated gzip members decode as one stream, like gunzip does.
+    if (done and not input.empty()) {
+      inflateReset(&stream);
+      done = false;
+    }
+    stream.next_in = (Bytef*)input.data();
+    stream.avail_in = input.size();
+    stream.next_out = (Bytef*)output;
+    stream.avail_out = capacity;
+    int status = inflate(&stream, Z_NO_FLUSH);
+    if (status != Z_OK and status != Z_STREAM_END and status != Z_BUF_ERROR) {
+      return -1;
+    }
+    done = status == Z_STREAM_END;
+    input.remove_prefix(input.size() - stream.avail_in);
+    return capacity - stream.avail_out;
+  }
+  bool finished() const override { return done; }
+
+ private:
+  z_stream stream = {};
+  bool done = false;
+};
+#endif
+
+#ifdef CDIFF_WITH_ZSTD
+class ZstdCompressor : public Compressor {
+ public:
+  ZstdCompressor() : context(ZSTD_createCCtx()), chunk(ZSTD_CStreamOutSize()) {}
+  ~ZstdCompressor() { ZSTD_freeCCtx(context); }
+
+  void write(std::string_view input, FILE* file) override {
+    run(input, file, ZSTD_e_continue);
+  }
+  void flush(FILE* file) override { run({}, file, ZSTD_e_flush); }
+  void finish(FILE* file) override { run({}, file, ZSTD_e_end); }
+
+ private:
+  void run(std::string_view input, FILE* file, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in = {input.data(), input.size(), 0};
+    size_t remaining;
+    do {
+      ZSTD_outBuffer out = {chunk.data(), chunk.size(), 0};
+      remaining = ZSTD_compressStream2(context, &out, &in, mode);
+      fwrite(chunk.data(), 1, out.pos, file);
+    } while (mode == ZSTD_e_continue ? in.pos < in.size : remaining != 0);
+  }
+
+  ZSTD_CCtx* context;
+  std::vector<char> chunk;
+};
+
+class ZstdDecompressor : public Decompressor {
+ public:
+  ZstdDecompressor() : context(ZSTD_createDCtx()) {}
+  ~ZstdDecompressor() { ZSTD_freeDCtx(context); }
+
+  long decompress(std::string_view& input, char* output,
+                  size_t capacity) override {
+    ZSTD_inBuffer in = {input.data(), input.size(), 0};
+    ZSTD_outBuffer out = {output, capacity, 0};
+    size_t status = ZSTD_decompressStream(context, &out, &in);
+    if (ZSTD_isError(status)) return -1;
+    // 0 means a frame just ended; a new one may follow in the same input.
+    // A call that makes no progress says nothing about that.
+    if (in.pos > 0 or out.pos > 0) done = status == 0;
+    input.remove_prefix(in.pos);
+    return out.pos;
+  }
+  bool finished() const override { return done; }
+
+ private:
+  ZSTD_DCtx* context;
+  bool done = false;
+};
+#endif
+
+// Callers check compression_supported() first, NONE gives no compressor.
+std::unique_ptr<Compressor> make_compressor(
+    [[maybe_unused]] Compression compression) {
+#ifdef CDIFF_WITH_ZLIB
+  if (compression == Compression::GZIP)
+    return std::make_unique<GzipCompressor>();
+#endif
+#ifdef CDIFF_WITH_ZSTD
+  if (compression == Compression::ZSTD)
+    return std::make_unique<ZstdCompressor>();
+#endif
+  return nullptr;
+}
+
+std::unique_ptr<Decompressor> make_decompressor(
+    [[maybe_unused]] Compression compression) {
+#ifdef CDIFF_WITH_ZLIB
+  if (compression == Compression::GZIP)
+    return std::make_unique<GzipDecompressor>();
+#endif
+#ifdef CDIFF_WITH_ZSTD
+  if (compression == Compression::ZSTD)
+    return std::make_unique<ZstdDecompressor>();
+#endif
+  return nullptr;
+}
+
+// Thrown by StreamReader when its input cannot be read or decoded. The
+// command line prints it and exits, batch fails just the job that hit it.
+struct ReadError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Reads a file front to back through a buffer that only grows to fit the
+// longest line (or read), so memory does not depend on the size of the file.
+// It can also read memory that is already loaded, and then the returned
+// views stay valid for as long as that memory does.
+class StreamReader {
+ public:
+  explicit StreamReader(const std::string& filename)
+      : filename(filename), buffer(1 << 16) {
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw ReadError("Error: opening the file " + filename);
+    data = buffer.data();
+  }
+  // Reads `fd`, such as stdin or a socket, and closes it when done.
+  StreamReader(int fd, const std::string& filename)
+      : filename(filename), fd(fd), buffer(1 << 16) {
+    data = buffer.data();
+  }
+  explicit StreamReader(std::string_view bytes,
+                        const std::string& filename = "")
+      : filename(filename), data(bytes.data()), end(bytes.size()), eof(true) {}
+  StreamReader(const StreamReader&) = delete;
+  StreamReader& operator=(const StreamReader&) = delete;
+  ~StreamReader() {
+    if (fd >= 0) close(fd);
+  }
+
+  // When reading a file, the view stays valid until the next call.
+  bool next_line(std::string_view& line) {
+    while (true) {
+      auto first = data + begin;
+      auto newline =
+          static_cast<const char*>(memchr(first, '\n', end - begin));
+      if (newline) {
+        line = std::string_view(first, newline - first);
+        begin = newline + 1 - data;
+        return true;
+      }
+
+      if (eof) {
+        if (begin == end) return false;
+        line = std::string_view(first, end - begin);
+        begin = end;
+        return true;
+      }
+
+      fill();
+    }
+  }
+
+  // Up to `count` bytes, without consuming them.
+  std::string_view peek(size_t count) {
+    while (end - begin < count and not eof) fill();
+    return std::string_view(data + begin, std::min(count, end - begin));
+  }
+
+  // Exactly `count` bytes, false if the input ends first.
+  bool read(size_t count, std::string_view& bytes) {
+    bytes = peek(count);
+    if (bytes.size() < count) return false;
+    begin += count;
+    return true;
+  }
+
+  // Whatever is buffered (at least one byte), false at the end of the input.
+  bool read_some(std::string_view& bytes) {
+    bytes = peek(1);
+    if (bytes.empty()) return false;
+    bytes = std::string_view(data + begin, end - begin);
+    begin = end;
+    return true;
+  }
+
+  // Reads the decompressed contents from now on if the input starts with a
+  // compression magic. False, with `error` set, if this build cannot decode
+  // it. Must be called before anything is consumed.
+  bool decompress(std::string& error) {
+    Compression compression = detect_compression(peek(4));
+    if (compression == Compression::NONE) return true;
+    if (not compression_supported(compression, error)) return false;
+    decompressor = make_decompressor(compression);
+
+    if (fd >= 0) {
+      raw.assign(data + begin, data + end);
+      raw.resize(std::max(raw.size(), size_t(1 << 16)));
+      pending = std::string_view(raw.data(), end - begin);
+    } else {
+      pending = std::string_view(data + begin, end - begin);
+      buffer.resize(1 << 16);
+    }
+    data = buffer.data();
+    begin = end = 0;
+    eof = false;
+    return true;
+  }
+
+ private:
+  void fill() {
+    memmove(buffer.data(), data + begin, end - begin);
+    end -= begin;
+    begin = 0;
+    if (end == buffer.size()) buffer.resize(2 * buffer.size());
+    data = buffer.data();
+
+    if (decompressor) {
+      inflate();
+      return;
+    }
+
+    ssize_t count = ::read(fd, buffer.data() + end, buffer.size() - end);
+    if (count < 0 and errno == ECONNRESET) count = 0;  // the peer went away
+    if (count < 0) throw ReadError("Error: reading the file " + filename);
+    eof = count == 0;
+    end += count;
+  }
+
+  // Decompresses until at least one byte is produced or the input ends.
+  void inflate() {
+    while (true) {
+      if (pending.empty() and fd >= 0 and not raw_eof) {
+        ssize_t count = ::read(fd, raw.data(), raw.size());
+        if (count < 0) throw ReadError("Error: reading the file " + filename);
+        raw_eof = count == 0;
+        pending = std::string_view(raw.data(), count);
+      }
+
+      // Called even without input, the decompressor may still hold output.
+      long count = decompressor->decompress(pending, buffer.data() + end,
+                                            buffer.size() - end);
+      if (count < 0) {
+        throw ReadError("Error: corrupt compressed file " + filename);
+      }
+      end += count;
+      if (count > 0) return;
+
+      if (pending.empty() and (fd < 0 or raw_eof)) {
+        if (not decompressor->finished()) {
+          throw ReadError("Error: truncated compressed file " + filename);
+        }
+        eof = true;
+        return;
+      }
+    }
+  }
+
+  std::string filename;
+  int fd = -1;
+  std::vector<char> buffer;
+  const char* data;
+  size_t begin = 0, end = 0;
+  bool eof = false;
+
+  std::unique_ptr<Decompressor> decompressor;
+  std::vector<char> raw;  // compressed bytes read from `fd`
+  std::string_view pending;
+  bool raw_eof = false;
+};
+
+// Replaces the contents of `file` with their decompressed form if they are
+// compressed; false, with `error` set, if this build cannot decode them.
+bool decompress_file(LineFile& file, const std::string& filename,
+                     std::string& error) {
+  StreamReader input(file.contents(), filename);
+  if (not input.decompress(error)) return false;
+  if (detect_compression(file.contents()) == Compression::NONE) return true;
+
+  LineFile result;
+  std::string_view bytes;
+  while (input.read_some(bytes)) result.buffer.append(bytes);
+  result.data = result.buffer.data();
+  result.index_lines();
+  file = std::move(result);
+  return true;
+}
+
+// Collects output in one large reusable buffer and hands it to `file` in
+// big writes instead of one (flushed) write per line. With flush_every > 0
+// the output is also flushed every that many lines, for readers that want
+// to see it line by line. With a `compressor` each full buffer is compressed
+// straight into `file` as it is drained, so compression keeps pace with the
+// output instead of running over all of it at the end.
+class OutputBuffer {
+ public:
+  explicit OutputBuffer(FILE* file, int flush_every = 0,
+                        std::unique_ptr<Compressor> compressor = nullptr,
+                        size_t capacity = 1 << 20)
+      : file(file),
+        flush_every(flush_every),
+        compressor(std::move(compressor)),
+        buffer(capacity) {}
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+  ~OutputBuffer() {
+    drain();
+    if (compressor) compressor->finish(file);
+    fflush(file);
+  }
+
+  void write(std::string_view text) {
+    if (used + text.size() > buffer.size()) {
+      drain();
+      if (text.size() > buffer.size()) {
+        put(text);
+        return;
+      }
+    }
+    memcpy(buffer.data() + used, text.data(), text.size());
+    used += text.size();
+  }
+
+  void write(char c) {
+    if (used == buffer.size()) drain();
+    buffer[used++] = c;
+  }
+
+  void write(int n) {
+    if (used + 16 > buffer.size()) drain();
+    auto [end, error] =
+        std::to_chars(buffer.data() + used, buffer.data() + buffer.size(), n);
+    used = end - buffer.data();
+  }
+
+  void end_line() {
+    write('\n');
+    ++lines;
+    if (flush_every > 0 and lines % flush_every == 0) flush();
+  }
+
+  void flush() {
+    drain();
+    if (compressor) compressor->flush(file);
+    fflush(file);
+  }
+
+  // So far, before any compression.
+  uint64_t lines_written() const { return lines; }
+  uint64_t bytes_written() const { return written + used; }
+
+ private:
+  void drain() {
+    put(std::string_view(buffer.data(), used));
+    used = 0;
+  }
+
+  void put(std::string_view bytes) {
+    written += bytes.size();
+    if (compressor) {
+      compressor->write(bytes, file);
+    } else {
+      fwrite(bytes.data(), 1, bytes.size(), file);
+    }
+  }
+
+  FILE* file;
+  int flush_every;
+  std::unique_ptr<Compressor> compressor;
+  uint64_t lines = 0;
+  uint64_t written = 0;  // bytes drained
+  std::vector<char> buffer;
+  size_t used = 0;
+};
+
+// --stats: what every phase of a run cost, and a few counters, written to
+// stderr as one JSON object once the run is over:
+//
+//   {"command":"diff","phases":[{"name":"load","wall_s":0.0021,
+//    "cpu_s":0.0019,"allocated_bytes":8448,"peak_rss_kb":6120},...],
+//    "counters":{"src_lines":100000,"dst_lines":100210,...}}
+//
+// peak_rss_kb is the high-water mark of the process when the phase ended.
+// A phase that comes up again adds to what it had. Disabled, every call is
+// a no-op.
+class Stats {
+ public:
+  Stats(std::string command, bool enabled)
+      : command(command), enabled(enabled) {
+    if (not enabled) return;
+    count_allocations = true;
+    last = sample();
+  }
+  Stats(const Stats&) = delete;
+  Stats& operator=(const Stats&) = delete;
+  ~Stats() {
+    if (not enabled) return;
+    end_phase();
+    write();
+  }
+
+  // Ends the phase that ran so far and starts `name`.
+  void phase(const char* name) {
+    if (not enabled) return;
+    end_phase();
+    current = name;
+  }
+
+  void count(const char* name, uint64_t value) {
+    if (enabled) counters.push_back({name, value});
+  }
+
+ private:
+  struct Sample {
+    double wall_s = 0;
+    double cpu_s = 0;
+    uint64_t allocated_bytes = 0;
+    long peak_rss_kb = 0;
+  };
+
+  static Sample sample() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    auto seconds = [](timeval time) {
+      return time.tv_sec + time.tv_usec / 1e6;
+    };
+    Sample now;
+    now.wall_s = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now().time_since_epoch())
+                     .count();
+    now.cpu_s = seconds(usage.ru_utime) + seconds(usage.ru_stime);
+    now.allocated_bytes = allocated_bytes.load(std::memory_order_relaxed);
+    now.peak_rss_kb = usage.ru_maxrss;
+    return now;
+  }
+
+  void end_phase() {
+    Sample now = sample();
+    if (current) {
+      auto phase = std::find_if(
+          phases.begin(), phases.end(),
+          [&](const auto& p) { return p.first == current; });
+      if (phase == phases.end()) {
+        phases.push_back({current, Sample()});
+        phase = phases.end() - 1;
+      }
+      Sample& total = phase->second;
+      total.wall_s += now.wall_s - last.wall_s;
+      total.cpu_s += now.cpu_s - last.cpu_s;
+      total.allocated_bytes += now.allocated_bytes - last.allocated_bytes;
+      total.peak_rss_kb = now.peak_rss_kb;
+    }
+    current = nullptr;
+    last = now;
+  }
+
+  void write() {
+    std::cerr << "{\"command\":\"" << command << "\",\"phases\":[";
+    for (size_t p = 0; p < phases.size(); ++p) {
+      const auto& [name, total] = phases[p];
+      std::cerr << (p > 0 ? "," : "") << "{\"name\":\"" << name
+                << "\",\"wall_s\":" << total.wall_s
+                << ",\"cpu_s\":" << total.cpu_s
+                << ",\"allocated_bytes\":" << total.allocated_bytes
+                << ",\"peak_rss_kb\":" << total.peak_rss_kb << "}";
+    }
+    std::cerr << "],\"counters\":{";
+    for (size_t c = 0; c < counters.size(); ++c) {
+      std::cerr << (c > 0 ? "," : "") << "\"" << counters[c].first
+                << "\":" << counters[c].second;
+    }
+    std::cerr << "}}" << std::endl;
+  }
+
+  std::string command;
+  bool enabled;
+  const char* current = nullptr;
+  Sample last;
+  std::vector<std::pair<std::string, Sample>> phases;
+  std::vector<std::pair<std::string, uint64_t>> counters;
+};
+
+// Writes `lines`, each ended by a newline, to `fd` straight from where they
+// are with writev, IOV_MAX pieces at a time.
+bool write_lines(int fd, const std::vector<std::string_view>& lines) {
+  static const char NEWLINE = '\n';
+  std::vector<iovec> pieces;
+  pieces.reserve(std::min<size_t>(2 * lines.size(), IOV_MAX));
+  for (size_t k = 0; k < lines.size();) {
+    pieces.clear();
+    for (; k < lines.size() and pieces.size() + 2 <= IOV_MAX; ++k) {
+      pieces.push_back({const_cast<char*>(lines[k].data()), lines[k].size()});
+      pieces.push_back({const_cast<char*>(&NEWLINE), 1});
+    }
+
+    // a write can stop anywhere, even inside a piece
+    iovec* first = pieces.data();
+    int count = pieces.size();
+    while (count > 0) {
+      ssize_t written = writev(fd, first, count);
+      if (written < 0 and errno == EINTR) continue;
+      if (written < 0) return false;
+      for (; count > 0 and size_t(written) >= first->iov_len; ++first) {
+        written -= first->iov_len;
+        count--;
+      }
+      if (count > 0) {
+        first->iov_base = static_cast<char*>(first->iov_base) + written;
+        first->iov_len -= written;
+      }
+    }
+  }
+  return true;
+}
+
+void write_to_file(const std::string& filename,
+                   const std::vector<std::string_view>& lines) {
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
     std::cout << "Error: opening the file " << filename << std::endl;
     exit(1);
   }
+  if (not write_lines(fd, lines) or close(fd) != 0) {
+    std::cout << "Error: writing the file " << filename << std::endl;
+    exit(1);
+  }
+}
+
+// umask() can only be read by setting it, and then it is put back.
+mode_t current_umask() {
+  mode_t mask = umask(0);
+  umask(mask);
+  return mask;
+}
+
+// A file written under a temporary name next to `path` and renamed over it
+// by commit(), so `path` never has anything but complete contents. One
+// dropped without a commit() is removed.
+class TempFile {
+ public:
+  TempFile() = default;
+  TempFile(const TempFile&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+  ~TempFile() {
+    if (file) fclose(file);
+    if (not name.empty() and not committed) unlink(name.c_str());
+  }
+
+  bool open(const std::string& path, mode_t mode, std::string& error) {
+    target = path;
+    auto parent = std::filesystem::path(path).parent_path();
+    dir = parent.empty() ? "." : parent.string();
+    name = dir + "/." + std::filesystem::path(path).filename().string() +
+           ".cdiff-XXXXXX";
+    int fd = mkstemp(name.data());
+    if (fd < 0) {
+      name.clear();
+      error = "Error: creating a temporary file next to " + path;
+      return false;
+    }
+    file = fdopen(fd, "w");
+    if (not file or fchmod(fd, mode) != 0) {
+      if (not file) close(fd);
+      error = "Error: creating a temporary file next to " + path;
+      return false;
+    }
+    return true;
+  }
+
+  FILE* stream() const { return file; }
+  const std::string& path() const { return name; }
+
+  // With `durable` the contents are synced before the rename, and the
+  // directory after it.
+  bool commit(bool durable, std::string& error) {
+    bool ok = fflush(file) == 0 and (not durable or fsync(fileno(file)) == 0);
+    ok = fclose(file) == 0 and ok;
+    file = nullptr;
+    ok = ok and rename(name.c_str(), target.c_str()) == 0;
+    if (not ok) {
+      error = "Error: writing the file " + target + ": " + strerror(errno);
+      return false;
+    }
+    committed = true;
+    if (durable) {
+      int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+      if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+      }
+    }
+    return true;
+  }
+
+ private:
+  std::string target, dir, name;
+  FILE* file = nullptr;
+  bool committed = false;
+};
+
+std::vector<uint32_t> intern_file(LineInterner& interner,
+                                  const LineFile& lines) {
+  std::vector<uint32_t> result(lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    result[i] = interner.intern(lines[i]);
+  }
+  return result;
+}
+
+// Hashes every line of both files once and gives each distinct line a dense
+// id, so the engines below compare integers instead of whole strings.
+InternedLines intern_lines(const LineFile& src, const LineFile& dst) {
+  LineInterner interner;
+  InternedLines interned;
+  interned.src = intern_file(interner, src);
+  interned.dst = intern_file(interner, dst);
+  interned.count = interner.count();
+  return interned;
+}
+
+// Matches both `--name=value` and `--name value`, advancing `i` past the
+// value in the latter case.
+bool option_value(const std::vector<std::string>& args, size_t& i,
+                  const std::string& name, std::string& value) {
+  const std::string& arg = args[i];
+  if (arg.rfind(name + "=", 0) == 0) {
+    value = arg.substr(name.size() + 1);
+    return true;
+  }
+  if (arg == name and i + 1 < args.size()) {
+    value = args[++i];
+    return true;
+  }
+  return false;
+}
+
+bool parse_int(const std::string& str, int& value) {
+  auto [end, error] =
+      std::from_chars(str.data(), str.data() + str.size(), value);
+  return error == std::errc() and end == str.data() + str.size();
+}
+
+class Subcommand {
+ public:
+  std::string name;
+  std::string signature;
+  std::string description;
+
+  Subcommand(std::string name, std::string signature, std::string description)
+      : name(name), signature(signature), description(description) {}
+  virtual int run(std::string program, std::vector<std::string> args) {
+    assert(false && "Not implemented");
+    return 0;
+  }
+};
+
+std::vector<Subcommand*> SUBCOMMANDS;
+
+void usage(std::string program) {
+  std::cout << "Usage: " << program << " <SUBCOMMAND> [OPTIONS]\n";
+  std::cout << "Subcommands:\n";
+
+  std::vector<int> lengths;
+  for (auto sub_cmd : SUBCOMMANDS) {
+    std::string str = sub_cmd->name + " " + sub_cmd->signature;
+    lengths.push_back(str.length());
+  }
+
+  int width = *std::max_element(lengths.begin(), lengths.end());
+
+  for (auto sub_cmd : SUBCOMMANDS) {
+    std::string command = sub_cmd->name + " " + sub_cmd->signature;
+
+    std::cout << "\t" << std::setw(width) << command << "\t"
+              << sub_cmd->description << "\n";
+  }
+}
+
+// Parses one `<action> <n> <line>` record of a text patch in place, so
+// `record.line` points into `line` and nothing is allocated.
+bool parse_move(std::string_view line, Move& record) {
+  if (line.size() < 3 or (line[0] != ADD and line[0] != REMOVE) or
+      line[1] != ' ') {
+    return false;
+  }
+
+  const char* end = line.data() + line.size();
+  auto [number_end, error] = std::from_chars(line.data() + 2, end, record.n);
+  if (error != std::errc() or record.n < 0) return false;
+  if (number_end < end and *number_end++ != ' ') return false;
+
+  record.action = line[0];
+  record.line = std::string_view(number_end, end - number_end);
+  return true;
+}
+
+// With --word-diff, a removed line and the added line that takes its place
+// can be written as one `~ <n> <m> <edits>` record for REMOVE n and ADD m.
+// Each edit is an action (IGNORE for kept text), its length in bytes, ':'
+// and that many bytes, and edits are separated by a space:
+//
+//   ~ 4 4 =4:int  -3:foo +3:bar =4: = 1
+//
+// Both lines can be rebuilt from the record alone.
+const char WORD_MOVE = '~';
+
+// Parses a WORD_MOVE record into the REMOVE and ADD it stands for, their
+// lines rebuilt in `src_line` and `dst_line`.
+bool parse_word_move(std::string_view line, Move& remove, Move& add,
+                     std::string& src_line, std::string& dst_line) {
+  if (line.size() < 3 or line[0] != WORD_MOVE or line[1] != ' ') return false;
+  const char* p = line.data() + 2;
+  const char* end = line.data() + line.size();
+  auto number = [&](int& value) {
+    auto [number_end, error] = std::from_chars(p, end, value);
+    if (error != std::errc() or value < 0) return false;
+    p = number_end;
+    return true;
+  };
+
+  src_line.clear();
+  dst_line.clear();
+  if (not number(remove.n) or p == end or *p++ != ' ' or not number(add.n)) {
+    return false;
+  }
+  while (p < end) {
+    int size;
+    if (*p++ != ' ' or p == end) return false;
+    char action = *p++;
+    if ((action != IGNORE and action != ADD and action != REMOVE) or
+        not number(size) or p == end or *p++ != ':' or end - p < size) {
+      return false;
+    }
+    std::string_view text(p, size);
+    if (action != ADD) src_line.append(text);
+    if (action != REMOVE) dst_line.append(text);
+    p += size;
+  }
+
+  remove.action = REMOVE;
+  remove.line = src_line;
+  add.action = ADD;
+  add.line = dst_line;
+  return true;
+}
+
+// With --detect-moves, blocks of added lines that repeat source lines (see
+// find_blocks) are written as one `<action> <n> <m> <count>` record, MOVE
+// or COPY, instead of a record per line, and a MOVE replaces the REMOVEs of
+// its source lines too. Their text is the source's, so unlike every other
+// record they cannot be applied with --stream.
+bool parse_block(std::string_view line, Block& block) {
+  if (line.size() < 3 or (line[0] != MOVE and line[0] != COPY) or
+      line[1] != ' ') {
+    return false;
+  }
+  const char* p = line.data() + 2;
+  const char* end = line.data() + line.size();
+  for (int* value : {&block.n, &block.m, &block.count}) {
+    if (value != &block.n and (p == end or *p++ != ' ')) return false;
+    auto [number_end, error] = std::from_chars(p, end, *value);
+    if (error != std::errc() or *value < 0) return false;
+    p = number_end;
+  }
+  block.action = line[0];
+  return p == end;
+}
+
+// Appends the records `block` stands for, false if its source lines are
+// beyond the end of `src`.
+bool expand_block(const Block& block, const LineFile& src,
+                  std::vector<Move>& patch) {
+  if (size_t(block.n) + block.count > src.size()) return false;
+  for (int k = 0; k < block.count; ++k) {
+    auto line = src[block.n + k];
+    if (block.action == MOVE) patch.push_back(Move(REMOVE, block.n + k, line));
+    patch.push_back(Move(ADD, block.m + k, line));
+  }
+  return true;
+}
+
+// How write_text_patch renders a patch besides one record per move.
+struct TextOptions {
+  bool word_diff = false;     // WORD_MOVE records for changed lines
+  bool detect_moves = false;  // MOVE and COPY records for repeated blocks
+  // when >= 0, a unified diff with this many lines of context instead
+  int context = -1;
+};
+
+// Writes `patch` as text records, any blocks first. With word_diff, every
+// run of changed lines that has no common line in between pairs off its
+// removed and added lines in order, and each pair whose lines share enough
+// to make it shorter becomes a WORD_MOVE record. That keeps the records in
+// an order stream_patch can follow.
+void write_text_patch(OutputBuffer& output, const std::vector<Move>& patch,
+                      const LineFile& src, const LineFile& dst,
+                      const TextOptions& text = TextOptions()) {
+  auto write_move = [&](const Move& move) {
+    output.write(move.action);
+    output.write(' ');
+    output.write(move.n);
+    output.write(' ');
+    output.write(move.action == ADD ? dst[move.n] : src[move.n]);
+    output.end_line();
+  };
+
+  // the moves that are not part of a block
+  std::vector<Move> rest;
+  const std::vector<Move>* moves = &patch;
+  if (text.detect_moves) {
+    std::vector<Block> blocks;
+    find_blocks(intern_lines(src, dst), patch, blocks);
+    std::vector<char> covered_src(src.size()), covered_dst(dst.size());
+    for (auto [action, n, m, count] : blocks) {
+      output.write(action);
+      output.write(' ');
+      output.write(n);
+      output.write(' ');
+      output.write(m);
+      output.write(' ');
+      output.write(count);
+      output.end_line();
+      if (action == MOVE) std::fill_n(&covered_src[n], count, true);
+      std::fill_n(&covered_dst[m], count, true);
+    }
+    for (const auto& move : patch) {
+      auto& covered = move.action == ADD ? covered_dst : covered_src;
+      if (not covered[move.n]) rest.push_back(move);
+    }
+    moves = &rest;
+  }
+
+  if (not text.word_diff) {
+    for (const auto& move : *moves) write_move(move);
+    return;
+  }
+
+  WordDiff words;
+
+  auto write_pair = [&](int n, int m) {
+    const auto& edits = words.diff(src[n], dst[m]);
+    size_t size = 0;
+    for (const auto& edit : edits) {
+      size += edit.text.size() + std::to_string(edit.text.size()).size() + 3;
+    }
+    if (size >= src[n].size() + dst[m].size() + 3) {
+      write_move(Move(REMOVE, n));
+      write_move(Move(ADD, m));
+      return;
+    }
+    output.write(WORD_MOVE);
+    output.write(' ');
+    output.write(n);
+    output.write(' ');
+    output.write(m);
+    for (const auto& edit : edits) {
+      output.write(' ');
+      output.write(edit.action);
+      output.write(int(edit.text.size()));
+      output.write(':');
+      output.write(edit.text);
+    }
+    output.end_line();
+  };
+
+  // Blocks taken out leave gaps in the edit path, which only make runs end
+  // early: every pairing is valid, stream_patch cannot read blocks anyway.
+  const auto& path = *moves;
+  int i = 0, j = 0;  // the point of the edit path before move k
+  for (size_t k = 0; k < path.size();) {
+    int common = path[k].n - (path[k].action == REMOVE ? i : j);
+    i += common, j += common;
+
+    // the run of moves from k on with no common line in between
+    int run_i = i, run_j = j;
+    while (k < path.size() and
+           path[k].n == (path[k].action == REMOVE ? i : j)) {
+      (path[k++].action == REMOVE ? i : j)++;
+    }
+    int pairs = std::min(i - run_i, j - run_j);
+    for (int p = 0; p < pairs; ++p) write_pair(run_i + p, run_j + p);
+    for (int n = run_i + pairs; n < i; ++n) write_move(Move(REMOVE, n));
+    for (int m = run_j + pairs; m < j; ++m) write_move(Move(ADD, m));
+  }
+}
+
+// Writes `patch` as a unified diff with `context` lines of context. The
+// hunks are built in the same walk along the edit path: each run of changed
+// lines is kept until the next one is known to be more than 2 * context
+// common lines away, which closes the hunk. Every line written is a view
+// of `src` or `dst`.
+//
+// Lines are compared without their newline, so a last line with none can
+// be common with a line that has one. As in GNU diff such a pair is written
+// as removed and added instead, each side with its own "No newline" marker.
+void write_unified_patch(OutputBuffer& output,
+                         const std::vector<Move>& edits, const LineFile& src,
+                         const LineFile& dst, int context,
+                         const std::string& src_name,
+                         const std::string& dst_name) {
+  auto open_end = [](const LineFile& file) {
+    return file.size() > 0 and file.contents().back() != '\n';
+  };
+  // only the last common pair can hold a last line
+  int common_i = -1, common_j = -1;
+  size_t after_common = 0;  // where the moves after it start
+  {
+    int i = 0, j = 0;
+    for (size_t k = 0; k < edits.size();) {
+      int common = edits[k].n - (edits[k].action == REMOVE ? i : j);
+      i += common, j += common;
+      if (common > 0) common_i = i - 1, common_j = j - 1, after_common = k;
+      while (k < edits.size() and
+             edits[k].n == (edits[k].action == REMOVE ? i : j)) {
+        (edits[k++].action == REMOVE ? i : j)++;
+      }
+    }
+    if (i < int(src.size())) {
+      common_i = src.size() - 1, common_j = dst.size() - 1;
+      after_common = edits.size();
+    }
+  }
+  bool src_open = common_i + 1 == int(src.size()) and open_end(src);
+  bool dst_open = common_j + 1 == int(dst.size()) and open_end(dst);
+  std::vector<Move> split;
+  if (common_i >= 0 and src_open != dst_open) {
+    split = edits;
+    split.insert(split.begin() + after_common,
+                 {Move(REMOVE, common_i), Move(ADD, common_j)});
+  }
+  const auto& patch = split.empty() ? edits : split;
+  if (patch.empty()) return;
+  output.write("--- " + src_name);
+  output.end_line();
+  output.write("+++ " + dst_name);
+  output.end_line();
+
+  auto write_line = [&](char mark, const LineFile& file, int n) {
+    output.write(mark);
+    output.write(file[n]);
+    output.end_line();
+    if (n + 1 == int(file.size()) and open_end(file)) {
+      output.write("\\ No newline at end of file");
+      output.end_line();
+    }
+  };
+  // `-start,count`, where a line count of 0 names the line before
+  auto write_range = [&](char mark, int start, int count) {
+    output.write(mark);
+    output.write(count == 0 ? start : start + 1);
+    if (count != 1) {
+      output.write(',');
+      output.write(count);
+    }
+  };
+
+  struct Run {
+    int i, j;  // where it starts
+    int removed, added;
+  };
+  std::vector<Run> hunk;
+  auto write_hunk = [&]() {
+    const auto& first = hunk.front();
+    const auto& last = hunk.back();
+    int before = std::min(context, first.i);
+    int after = std::min<int>(context, src.size() - last.i - last.removed);
+    int i0 = first.i - before, j0 = first.j - before;
+    int i1 = last.i + last.removed + after;
+    int j1 = last.j + last.added + after;
+
+    output.write("@@ ");
+    write_range(REMOVE, i0, i1 - i0);
+    output.write(' ');
+    write_range(ADD, j0, j1 - j0);
+    output.write(" @@");
+    output.end_line();
+
+    int i = i0;
+    for (const auto& run : hunk) {
+      for (; i < run.i; ++i) write_line(' ', src, i);
+      for (int k = 0; k < run.removed; ++k) write_line(REMOVE, src, i++);
+      for (int k = 0; k < run.added; ++k) write_line(ADD, dst, run.j + k);
+    }
+    for (; i < i1; ++i) write_line(' ', src, i);
+    hunk.clear();
+  };
+
+  int i = 0, j = 0;  // the point of the edit path before move k
+  for (size_t k = 0; k < patch.size();) {
+    int common = patch[k].n - (patch[k].action == REMOVE ? i : j);
+    i += common, j += common;
+    if (not hunk.empty() and common > 2 * context) write_hunk();
+
+    Run run = {i, j, 0, 0};
+    while (k < patch.size() and
+           patch[k].n == (patch[k].action == REMOVE ? i : j)) {
+      (patch[k++].action == REMOVE ? i : j)++;
+    }
+    run.removed = i - run.i;
+    run.added = j - run.j;
+    hunk.push_back(run);
+  }
+  write_hunk();
+}
+
+// Yields the records of a patch one at a time, in file order.
+class PatchReader {
+ public:
+  virtual ~PatchReader() = default;
+
+  // False at the end of the patch, or when it is malformed, in which case
+  // `error` says why.
+  virtual bool next(Move& record) = 0;
+  // Where the last record came from, for messages.
+  virtual std::string location() const = 0;
+
+  std::string error;
+  bool removes_have_text = true;
+};
+
+class TextPatchReader : public PatchReader {
+ public:
+  TextPatchReader(StreamReader& input, const std::string& path)
+      : input(input), path(path) {}
+
+  bool next(Move& record) override {
+    if (pending.n >= 0) {
+      record = pending;
+      pending = Move();
+      return true;
+    }
+    std::string_view line;
+    while (input.next_line(line)) {
+      row++;
+      if (line.size() == 0) continue;
+      if (parse_move(line, record)) return true;
+      if (parse_word_move(line, record, pending, src_line, dst_line)) {
+        return true;
+      }
+      Block block;
+      if (parse_block(line, block)) {
+        error = location() + ": Move and copy records cannot be streamed: " +
+                std::string(line);
+        return false;
+      }
+
+      error = location() + ": Invalid patch action: " + std::string(line);
+      return false;
+    }
+    return false;
+  }
+
+  std::string location() const override {
+    return path + ":" + std::to_string(row);
+  }
+
+ private:
+  StreamReader& input;
+  std::string path;
+  int row = 0;
+  // the ADD half of a WORD_MOVE, returned by the next call
+  Move pending;
+  std::string src_line, dst_line;
+};
+
+// A binary patch starts with BINARY_MAGIC, a version and a flags byte,
+// followed by groups of consecutive ADD or REMOVE records:
+//
+//   tag     GROUP_ADD or GROUP_REMOVE, GROUP_END after the last group
+//   varint  zigzag delta from where the previous group of the same action
+//           ended to the first n of this one
+//   varint  number of records, for n, n + 1, ...
+//
+// REMOVE groups carry nothing else, the removed text is the source's. Each
+// line of an ADD group is a varint v followed by v >> 1 bytes of text when v
+// is even. With SOURCE_REFS, an odd v copies the source line at the zigzag
+// delta v >> 1 from the previously referenced one instead.
+const std::string_view BINARY_MAGIC("CDIFF\0", 6);
+const char BINARY_VERSION = 1;
+const char SOURCE_REFS = 1;
+
+const char GROUP_END = 0;
+const char GROUP_ADD = 1;
+const char GROUP_REMOVE = 2;
+
+uint64_t zigzag(int64_t value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+size_t varint_size(uint64_t value) {
+  size_t size = 1;
+  for (; value >= 0x80; value >>= 7) size++;
+  return size;
+}
+
+void write_varint(OutputBuffer& output, uint64_t value) {
+  char bytes[10];
+  int size = 0;
+  for (; value >= 0x80; value >>= 7) bytes[size++] = char(value | 0x80);
+  bytes[size++] = char(value);
+  output.write(std::string_view(bytes, size));
+}
+
+// Writes `patch` as a binary patch. With `refs`, every added line that also
+// occurs in the source is stored as a reference whenever that is shorter.
+void write_binary_patch(OutputBuffer& output, const std::vector<Move>& patch,
+                        const LineFile& dst, const InternedLines* refs) {
+  output.write(BINARY_MAGIC);
+  output.write(BINARY_VERSION);
+  output.write(refs ? SOURCE_REFS : char(0));
+
+  // first src index of every line id, -1 for lines only in dst
+  std::vector<int> source_line;
+  if (refs) {
+    source_line.assign(refs->count, -1);
+    for (int i = refs->src.size() - 1; i >= 0; --i) {
+      source_line[refs->src[i]] = i;
+    }
+  }
+
+  int ends[2] = {0, 0};  // where the last ADD and REMOVE group ended
+  int previous_ref = 0;
+  for (size_t first = 0; first < patch.size();) {
+    char action = patch[first].action;
+    size_t last = first + 1;
+    while (last < patch.size() and patch[last].action == action and
+           patch[last].n == patch[last - 1].n + 1) {
+      last++;
+    }
+
+    int& end = ends[action == ADD ? 0 : 1];
+    output.write(action == ADD ? GROUP_ADD : GROUP_REMOVE);
+    write_varint(output, zigzag(patch[first].n - end));
+    write_varint(output, last - first);
+    end = patch[first].n + (last - first);
+
+    for (size_t k = first; action == ADD and k < last; ++k) {
+      int n = patch[k].n;
+      auto line = dst[n];
+      uint64_t literal = uint64_t(line.size()) << 1;
+
+      int ref = refs ? source_line[refs->dst[n]] : -1;
+      if (ref >= 0) {
+        uint64_t reference = zigzag(ref - previous_ref) << 1 | 1;
+        if (varint_size(reference) < varint_size(literal) + line.size()) {
+          write_varint(output, reference);
+          previous_ref = ref;
+          continue;
+        }
+      }
+
+      write_varint(output, literal);
+      output.write(line);
+    }
+
+    first = last;
+  }
+
+  output.write(GROUP_END);
+}
+
+class BinaryPatchReader : public PatchReader {
+ public:
+  // `src` provides the text of removed and referenced lines. Without it,
+  // REMOVE records have no text and references are an error.
+  BinaryPatchReader(StreamReader& input, const std::string& path,
+                    const LineFile* src)
+      : input(input), path(path), src(src) {
+    removes_have_text = src != nullptr;
+
+    std::string_view header;
+    if (not input.read(BINARY_MAGIC.size() + 2, header) or
+        header.substr(0, BINARY_MAGIC.size()) != BINARY_MAGIC) {
+      error = path + ": Not a binary patch";
+    } else if (header[BINARY_MAGIC.size()] != BINARY_VERSION) {
+      error = path + ": Unsupported binary patch version " +
+              std::to_string(header[BINARY_MAGIC.size()]);
+    } else if (header[BINARY_MAGIC.size() + 1] & SOURCE_REFS) {
+      refs = true;
+      if (not src) error = path + ": Source references need the whole source";
+    }
+  }
+
+  bool next(Move& record) override {
+    if (done or not error.empty()) return false;
+
+    if (remaining == 0) {
+      std::string_view byte;
+      if (not input.read(1, byte)) return fail("Truncated patch");
+      char tag = byte[0];
+      if (tag == GROUP_END) {
+        done = true;
+        return false;
+      }
+      if (tag != GROUP_ADD and tag != GROUP_REMOVE) {
+        return fail("Invalid group tag " + std::to_string(tag));
+      }
+
+      uint64_t delta, count;
+      if (not read_varint(delta) or not read_varint(count)) {
+        return fail("Truncated patch");
+      }
+      action = tag == GROUP_ADD ? ADD : REMOVE;
+      int& end = ends[action == ADD ? 0 : 1];
+      n = end + unzigzag(delta);
+      if (n < 0 or count == 0) return fail("Invalid group");
+      remaining = count;
+      end = n + count;
+    }
+
+    records++;
+    remaining--;
+    record.action = action;
+    record.n = n++;
+    record.line = std::string_view();
+
+    if (action == REMOVE) {
+      if (src and record.n < (int)src->size()) record.line = (*src)[record.n];
+      return true;
+    }
+
+    uint64_t value;
+    if (not read_varint(value)) return fail("Truncated patch");
+    if (value & 1) {
+      int64_t ref = previous_ref + unzigzag(value >> 1);
+      if (not refs or ref < 0 or ref >= (int64_t)src->size()) {
+        return fail("Invalid source reference");
+      }
+      previous_ref = ref;
+      record.line = (*src)[ref];
+    } else if (not input.read(value >> 1, record.line)) {
+      return fail("Truncated patch");
+    }
+    return true;
+  }
+
+  std::string location() const override {
+    return path + ": record " + std::to_string(records);
+  }
+
+ private:
+  bool fail(const std::string& message) {
+    error = location() + ": " + message;
+    return false;
+  }
+
+  bool read_varint(uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      std::string_view byte;
+      if (not input.read(1, byte)) return false;
+      value |= uint64_t(byte[0] & 0x7f) << shift;
+      if (not(byte[0] & 0x80)) return true;
+    }
+    return false;
+  }
+
+  StreamReader& input;
+  std::string path;
+  const LineFile* src;
+  bool refs = false;
+  bool done = false;
+
+  char action = ADD;
+  int n = 0;
+  uint64_t remaining = 0;  // records left in the current group
+  int ends[2] = {0, 0};
+  int64_t previous_ref = 0;
+  int records = 0;
+};
+
+// XXH64, used to recognize inputs the diff cache has seen before.
+uint64_t hash_bytes(std::string_view bytes, uint64_t seed = 0) {
+  const uint64_t P1 = 0x9E3779B185EBCA87, P2 = 0xC2B2AE3D27D4EB4F,
+                 P3 = 0x165667B19E3779F9, P4 = 0x85EBCA77C2B2AE63,
+                 P5 = 0x27D4EB2F165667C5;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto read64 = [](const char* p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return value;
+  };
+  auto round = [&](uint64_t acc, uint64_t input) {
+    return rotl(acc + input * P2, 31) * P1;
+  };
+  auto merge = [&](uint64_t acc, uint64_t value) {
+    return (acc ^ round(0, value)) * P1 + P4;
+  };
+
+  const char* p = bytes.data();
+  const char* end = p + bytes.size();
+  uint64_t h;
+  if (bytes.size() >= 32) {
+    uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+  } else {
+    h = seed + P5;
+  }
+
+  h += bytes.size();
+  for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+  if (p + 4 <= end) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    h = rotl(h ^ (value * P1), 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p < end; ++p) h = rotl(h ^ (uint8_t(*p) * P5), 11) * P1;
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Remembers patches across runs in `dir`, keyed by the contents of both files
+// and by `options`, which must name everything that shapes the patch. Each
+// entry is a binary patch with source references. It is written to a
+// temporary file and renamed into place, so processes sharing the directory
+// only ever see complete entries. An entry's mtime is its last use; once the
+// entries outgrow `max_bytes` the least recently used ones are removed. The
+// cache is best effort: an entry that is missing, unreadable or does not fit
+// the files is a miss, and failing to store one is ignored.
+class DiffCache {
+ public:
+  DiffCache(const std::string& dir, const std::string& options,
+            uint64_t max_bytes)
+      : dir(dir), options(options), max_bytes(max_bytes) {}
+
+  // The path of the entry for this pair of files.
+  std::string entry(const LineFile& src, const LineFile& dst) const {
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx-%016llx-%016llx.cdiff",
+             (unsigned long long)hash_bytes(src.contents()),
+             (unsigned long long)hash_bytes(dst.contents()),
+             (unsigned long long)hash_bytes(options, BINARY_VERSION));
+    return dir + "/" + name;
+  }
+
+  bool load(const std::string& entry, const LineFile& src, const LineFile& dst,
+            std::vector<Move>& patch) const {
+    int fd = open(entry.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    std::string bytes;
+    char chunk[1 << 16];
+    ssize_t count;
+    while ((count = read(fd, chunk, sizeof(chunk))) > 0) {
+      bytes.append(chunk, count);
+    }
+    futimens(fd, nullptr);  // mark it as just used
+    close(fd);
+    if (count < 0) return false;
+
+    StreamReader input(bytes, entry);
+    BinaryPatchReader reader(input, entry, &src);
+    patch.clear();
+    Move record;
+    while (reader.next(record)) {
+      int lines = record.action == ADD ? dst.size() : src.size();
+      if (record.n >= lines) return false;
+      patch.emplace_back(record.action, record.n);
+    }
+    return reader.error.empty();
+  }
+
+  void store(const std::string& entry, const std::vector<Move>& patch,
+             const LineFile& dst, const InternedLines& interned) const {
+    static std::atomic<int> counter = 0;
+    std::string temporary = dir + "/.tmp-" + std::to_string(getpid()) + "-" +
+                            std::to_string(counter++);
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (not file) return;
+    {
+      OutputBuffer output(file);
+      write_binary_patch(output, patch, dst, &interned);
+    }
+    bool written = not ferror(file);
+    if (fclose(file) != 0 or not written or
+        rename(temporary.c_str(), entry.c_str()) != 0) {
+      unlink(temporary.c_str());
+      return;
+    }
+    evict();
+  }
+
+ private:
+  void evict() const {
+    struct Entry {
+      std::filesystem::file_time_type used;
+      uint64_t size;
+      std::filesystem::path path;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    std::error_code error;
+    auto now = std::filesystem::file_time_type::clock::now();
+    for (const auto& file : std::filesystem::directory_iterator(dir, error)) {
+      auto used = file.last_write_time(error);
+      auto size = file.file_size(error);
+      if (error) continue;
+      auto name = file.path().filename().string();
+      if (name.rfind(".tmp-", 0) == 0) {
+        // left behind by a process that died while storing
+        if (now - used > std::chrono::hours(1)) {
+          std::filesystem::remove(file.path(), error);
+        }
+      } else if (file.path().extension() == ".cdiff") {
+        entries.push_back({used, size, file.path()});
+        total += size;
+      }
+    }
+    if (total <= max_bytes) return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& e1, const Entry& e2) { return e1.used < e2.used; });
+    for (const auto& [used, size, path] : entries) {
+      if (total <= max_bytes) break;
+      // another process may have removed it already, that is just as good
+      std::filesystem::remove(path, error);
+      total -= size;
+    }
+  }
+
+  std::string dir;
+  std::string options;
+  uint64_t max_bytes;
+};
+
+// Diffs two loaded files, going through `cache` when there is one. `within`
+// is set to whether the patch stayed within options.budget. Only exact
+// patches are cached, and those do not depend on the budget, so a cached one
+// is only checked against the distance. `scratch` is the engines' to reuse,
+// and the phases are recorded in `stats` when there is one.
+std::vector<Move> diff_files(const LineFile& src, const LineFile& dst,
+                             const DiffOptions& options,
+                             const DiffCache* cache, Scratch& scratch,
+                             bool& within, Stats* stats = nullptr) {
+  std::vector<Move> patch;
+  std::string entry;
+  if (cache) {
+    if (stats) stats->phase("cache");
+    entry = cache->entry(src, dst);
+    if (cache->load(entry, src, dst, patch)) {
+      within = not options.budget.over(patch.size());
+      return patch;
+    }
+  }
+
+  if (stats) stats->phase("intern");
+  auto interned = intern_lines(src, dst);
+  if (stats) stats->phase("trim");
+  std::vector<Region> regions;
+  split_regions(interned.src, interned.dst, interned.count, options, scratch,
+                regions);
+  if (stats) stats->phase("diff");
+  within = diff_regions(regions, options, scratch, patch);
+  if (stats) {
+    stats->count("distinct_lines", interned.count);
+    stats->count("regions", regions.size());
+    const auto& counters = scratch.counters;
+    stats->count("cells", counters.cells);
+    if (options.engine == auto_diff) {
+      stats->count("auto_dp", counters.dp);
+      stats->count("auto_myers", counters.myers);
+      stats->count("auto_bit_parallel", counters.bit_parallel);
+      stats->count("auto_linear_space", counters.linear_space);
+      stats->count("auto_switched", counters.switched);
+    }
+  }
+  if (cache and within) {
+    if (stats) stats->phase("cache");
+    cache->store(entry, patch, dst, interned);
+  }
+  return patch;
+}
+
+// In a tree patch every file starts with a header row naming its path
+// relative to the tree: "# path" for a changed file, "#+ path" for a new one
+// and "#- path" for a removed one. The records that follow are the file's
+// ordinary text patch, a missing file counting as empty.
+const std::string TREE_HEADER = "#";
+
+// Loads the paths of the regular files under `root`, relative to it and
+// sorted, into `paths`; false, with `error` set, if the tree cannot be
+// walked.
+bool list_files(const std::string& root, std::vector<std::string>& paths,
+                std::string& error) {
+  paths.clear();
+  std::error_code code;
+  std::filesystem::recursive_directory_iterator entry(root, code), end;
+  for (; not code and entry != end; entry.increment(code)) {
+    std::error_code ignored;
+    if (not entry->is_regular_file(ignored)) continue;
+    paths.push_back(entry->path().lexically_relative(root).generic_string());
+  }
+  if (code) {
+    error = "Error: listing the directory " + root + ": " + code.message();
+    return false;
+  }
+  std::sort(paths.begin(), paths.end());
+  return true;
+}
+
+// Compares sizes and then the bytes a block at a time, so unchanged files
+// are skipped without building their line index.
+bool same_contents(const std::string& path1, const std::string& path2) {
+  std::error_code error;
+  auto size1 = std::filesystem::file_size(path1, error);
+  if (error or size1 != std::filesystem::file_size(path2, error) or error) {
+    return false;
+  }
+
+  int fd1 = open(path1.c_str(), O_RDONLY);
+  int fd2 = open(path2.c_str(), O_RDONLY);
+  bool same = fd1 >= 0 and fd2 >= 0;
+  std::vector<char> block1(1 << 16), block2(1 << 16);
+  while (same) {
+    ssize_t count1 = read(fd1, block1.data(), block1.size());
+    ssize_t count2 = count1 > 0 ? read(fd2, block2.data(), count1) : 0;
+    if (count1 <= 0) {
+      same = count1 == 0;
+      break;
+    }
+    same = count1 == count2 and
+           memcmp(block1.data(), block2.data(), count1) == 0;
+  }
+  if (fd1 >= 0) close(fd1);
+  if (fd2 >= 0) close(fd2);
+  return same;
+}
+
+// Diffs every file of `src_root` against the one at the same path under
+// `dst_root` and writes the tree patch. Files are diffed on `options.jobs`
+// threads, one file per task, and written in path order as `text` says.
+// The budget applies to each file; if one goes over it without
+// options.approximate, nothing is written, its path is left in `failed` and
+// false is returned. A tree or file that cannot be read likewise writes
+// nothing and returns false, with `error` set for the first in path order.
+bool diff_trees(const std::string& src_root, const std::string& dst_root,
+                const DiffOptions& options, const DiffCache* cache,
+                const TextOptions& text, OutputBuffer& output,
+                std::string& failed, std::string& error) {
+  std::vector<std::string> src_paths, dst_paths;
+  if (not list_files(src_root, src_paths, error) or
+      not list_files(dst_root, dst_paths, error)) {
+    return false;
+  }
+  std::vector<std::string> paths;
+  std::set_union(src_paths.begin(), src_paths.end(), dst_paths.begin(),
+                 dst_paths.end(), std::back_inserter(paths));
+
+  DiffOptions file_options = options;
+  file_options.jobs = 1;
+
+  // each file's part of the patch, rendered by whichever thread diffed it
+  std::vector<std::string> sections(paths.size());
+  std::vector<char> exceeded(paths.size());
+  // read errors are kept per file, as no worker may exit or print
+  std::vector<std::string> errors(paths.size());
+  auto diff_file = [&](size_t k) {
+    const auto& path = paths[k];
+    std::string src_path = src_root + "/" + path;
+    std::string dst_path = dst_root + "/" + path;
+    bool in_src =
+        std::binary_search(src_paths.begin(), src_paths.end(), path);
+    bool in_dst =
+        std::binary_search(dst_paths.begin(), dst_paths.end(), path);
+    if (in_src and in_dst and same_contents(src_path, dst_path)) return;
+
+    LineFile lines1, lines2;
+    if ((in_src and not read_file(src_path, lines1, errors[k])) or
+        (in_dst and not read_file(dst_path, lines2, errors[k]))) {
+      return;
+    }
+    bool within = true;
+    thread_local Scratch scratch;
+    auto patch =
+        diff_files(lines1, lines2, file_options, cache, scratch, within);
+    if (not within and not options.approximate) {
+      exceeded[k] = true;
+      return;
+    }
+    if (patch.empty() and in_src and in_dst) return;
+
+    char* bytes = nullptr;
+    size_t size = 0;
+    FILE* file = open_memstream(&bytes, &size);
+    {
+      OutputBuffer section(file);
+      if (text.context >= 0) {
+        // a missing file is /dev/null, as in git's unified diffs
+        write_unified_patch(section, patch, lines1, lines2, text.context,
+                            in_src ? src_path : "/dev/null",
+                            in_dst ? dst_path : "/dev/null");
+      } else {
+        section.write(TREE_HEADER);
+        if (not in_src) section.write(ADD);
+        if (not in_dst) section.write(REMOVE);
+        section.write(' ');
+        section.write(path);
+        section.end_line();
+        write_text_patch(section, patch, lines1, lines2, text);
+      }
+    }
+    fclose(file);
+    sections[k].assign(bytes, size);
+    free(bytes);
+  };
+
+  if (options.jobs <= 1) {
+    for (size_t k = 0; k < paths.size(); ++k) diff_file(k);
+  } else {
+    std::atomic<bool> out_of_memory = false;
+    {
+      ThreadPool pool(std::min<size_t>(options.jobs, paths.size()));
+      for (size_t k = 0; k < paths.size(); ++k) {
+        pool.submit([&, k] {
+          try {
+            diff_file(k);
+          } catch (const std::bad_alloc&) {
+            out_of_memory = true;
+          }
+        });
+      }
+      pool.wait();
+    }
+    if (out_of_memory) throw std::bad_alloc();
+  }
+
+  for (size_t k = 0; k < paths.size(); ++k) {
+    if (not errors[k].empty()) {
+      error = errors[k];
+      return false;
+    }
+    if (not exceeded[k]) continue;
+    failed = paths[k];
+    return false;
+  }
+  for (const auto& section : sections) output.write(section);
+  return true;
+}
+
+// MemAvailable of /proc/meminfo, or 0 when it cannot be read.
+uint64_t available_memory() {
+  FILE* file = fopen("/proc/meminfo", "r");
+  if (not file) return 0;
+  char line[256];
+  unsigned long long kb;
+  uint64_t bytes = 0;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+      bytes = uint64_t(kb) << 10;
+      break;
+    }
+  }
+  fclose(file);
+  return bytes;
+}
+
+// Sets options.engine for --algorithm and --linear-space, after
+// options.jobs; false, with `error` set, for a combination there is not.
+bool select_engine(const std::string& algorithm, bool linear_space,
+                   DiffOptions& options, std::string& error) {
+  if (algorithm != "myers" and algorithm != "dp" and
+      algorithm != "bitparallel" and algorithm != "auto") {
+    error = "unknown algorithm " + algorithm;
+    return false;
+  }
+  if (linear_space and algorithm != "myers") {
+    error = "--linear-space requires --algorithm=myers";
+    return false;
+  }
+
+  if (algorithm == "dp") {
+    options.engine = edit_distance;
+  } else if (algorithm == "bitparallel") {
+    options.engine = bit_parallel_diff;
+  } else if (algorithm == "auto") {
+    options.engine = auto_diff;
+    // half of what is free, shared by the jobs and rounded down to a power
+    // of two, so the engines it allows only change in big steps
+    uint64_t bytes = available_memory() / 2 / options.jobs;
+    if (bytes > 0) bytes = uint64_t(1) << (63 - __builtin_clzll(bytes));
+    options.budget.max_bytes = bytes;
+  } else if (linear_space) {
+    options.engine = myers_linear_diff;
+  }
+  return true;
+}
+
+// Exit codes of `diff`: --stat and --quiet tell the files differ, and any
+// diff may be further apart than the budget.
+const int EXIT_DIFFERENT = 1;
+const int EXIT_TOO_DIFFERENT = 2;
+
+// For --quiet, which the first differing line settles.
+bool same_lines(const LineFile& src, const LineFile& dst) {
+  if (src.size() != dst.size()) return false;
+  for (size_t i = 0; i < src.size(); ++i) {
+    if (src[i] != dst[i]) return false;
+  }
+  return true;
+}
+
+class DiffSubcommand : public Subcommand {
+ public:
+  DiffSubcommand()
+      : Subcommand("diff",
+                   "[--algorithm=myers|dp|bitparallel|auto] "
+                   "[--linear-space] [--patience] [--jobs N] [--flush-every N] "
+                   "[--format=text|bin|unified] [-U N] [--source-refs] "
+                   "[--compress=none|gzip|zstd] [-r] [--cache-dir DIR] "
+                   "[--cache-size MB] [--max-distance D] [--deadline MS] "
+                   "[--approximate] [--stat | --quiet] [--word-diff] "
+                   "[--detect-moves] [--stats] <file1> <file2>",
+                   "print the difference between the files (or, with -r, "
+                   "the directory trees) to stdout, or with --stat only "
+                   "count the changes and with --quiet only tell whether "
+                   "there are any; --stats reports the cost of every phase "
+                   "to stderr as JSON") {}
+
+  int run(std::string program, std::vector<std::string> args) override {
+    std::string usage = "Usage: " + program + " " + name + " " + signature;
+
+    std::string algorithm = "myers";
+    bool linear_space = false;
+    DiffOptions options;
+    int flush_every = 0;
+    std::string format = "text";
+    bool source_refs = false;
+    Compression compression = Compression::NONE;
+    bool recursive = false;
+    std::string cache_dir;
+    int cache_size = 1024;
+    int deadline = -1;
+    bool stat = false;
+    bool quiet = false;
+    bool report = false;
+    TextOptions text;
+    int context = -1;
+    std::vector<std::string> files;
+    for (size_t i = 0; i < args.size(); ++i) {
+      std::string arg = args[i];
+      std::string value;
+      if (arg.rfind("--algorithm=", 0) == 0) {
+        algorithm = arg.substr(arg.find('=') + 1);
+      } else if (arg == "--linear-space") {
+        linear_space = true;
+      } else if (arg == "--patience") {
+        options.patience = true;
+      } else if (option_value(args, i, "--jobs", value)) {
+        if (not parse_int(value, options.jobs) or options.jobs < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid number of jobs " << value << '\n';
+          return -1;
+        }
+        if (options.jobs == 0) {
+          options.jobs = std::max(1u, std::thread::hardware_concurrency());
+        }
+      } else if (option_value(args, i, "--flush-every", value)) {
+        if (not parse_int(value, flush_every) or flush_every < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid line count " << value << '\n';
+          return -1;
+        }
+      } else if (option_value(args, i, "--format", value)) {
+        format = value;
+      } else if (option_value(args, i, "-U", value) or
+                 (arg.rfind("-U", 0) == 0 and arg.size() > 2)) {
+        if (value.empty()) value = arg.substr(2);  // as in -U5
+        if (not parse_int(value, context) or context < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid number of context lines " << value
+                    << '\n';
+          return -1;
+        }
+      } else if (arg == "--source-refs") {
+        source_refs = true;
+      } else if (arg == "-r") {
+        recursive = true;
+      } else if (option_value(args, i, "--cache-dir", value)) {
+        cache_dir = value;
+      } else if (option_value(args, i, "--cache-size", value)) {
+        if (not parse_int(value, cache_size) or cache_size < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid cache size " << value << '\n';
+          return -1;
+        }
+      } else if (option_value(args, i, "--max-distance", value)) {
+        if (not parse_int(value, options.budget.max_distance) or
+            options.budget.max_distance < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid distance " << value << '\n';
+          return -1;
+        }
+      } else if (option_value(args, i, "--deadline", value)) {
+        if (not parse_int(value, deadline) or deadline < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid deadline " << value << '\n';
+          return -1;
+        }
+      } else if (arg == "--approximate") {
+        options.approximate = true;
+      } else if (arg == "--stat") {
+        stat = true;
+      } else if (arg == "--quiet") {
+        quiet = true;
+      } else if (arg == "--word-diff") {
+        text.word_diff = true;
+      } else if (arg == "--detect-moves") {
+        text.detect_moves = true;
+      } else if (arg == "--stats") {
+        report = true;
+      } else if (option_value(args, i, "--compress", value)) {
+        std::string error;
+        if (not parse_compression(value, compression)) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: unknown compression " << value << '\n';
+          return -1;
+        }
+        if (not compression_supported(compression, error)) {
+          std::cout << "ERROR: " << error << '\n';
+          return -1;
+        }
+      } else if (arg.rfind("--", 0) == 0) {
+        std::cout << usage << '\n';
+        std::cout << "ERROR: unknown option " << arg << '\n';
+        return -1;
+      } else {
+        files.push_back(arg);
+      }
+    }
+
+    if (format != "text" and format != "bin" and format != "unified") {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: unknown format " << format << '\n';
+      return -1;
+    }
+
+    if (recursive and format == "bin") {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: -r requires --format=text or unified\n";
+      return -1;
+    }
+
+    if (context >= 0 and format != "unified") {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: -U requires --format=unified\n";
+      return -1;
+    }
+    if (format == "unified") text.context = context < 0 ? 3 : context;
+
+    if (source_refs and format != "bin") {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: --source-refs requires --format=bin\n";
+      return -1;
+    }
+
+    if (text.word_diff and format != "text") {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: --word-diff requires --format=text\n";
+      return -1;
+    }
+
+    if (text.detect_moves and format != "text") {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: --detect-moves requires --format=text\n";
+      return -1;
+    }
+
+    if (stat and quiet) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: --stat and --quiet cannot be used together\n";
+      return -1;
+    }
+
+    if ((stat or quiet) and recursive) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: --stat and --quiet cannot be used with -r\n";
+      return -1;
+    }
 
-  std::string line;
-  std::vector<std::string> lines;
-  while (getline(inputFile, line)) lines.push_back(line);
+    if (stat and options.approximate) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: --stat cannot be used with --approximate\n";
+      return -1;
+    }
 
-  inputFile.close();
-  return lines;
-}
+    std::string error;
+    if (not select_engine(algorithm, linear_space, options, error)) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: " << error << '\n';
+      return -1;
+    }
 
-void write_to_file(const std::string& filename,
-                   const std::vector<std::string> lines) {
-  std::ofstream outputFile(filename);
-  if (not outputFile.is_open()) {
-    std::cout << "Error: opening the file " << filename << std::endl;
-    exit(1);
-  }
+    if (files.size() < 2) {
+      std::string error = "ERROR: not enough files were provided to " + name;
 
-  for (auto line : lines) {
-    outputFile << line << '\n';
-  }
+      std::cout << usage << '\n';
+      std::cout << error << '\n';
 
-  outputFile.close();
-}
+      return -1;
+    }
 
-const char IGNORE = '=';
-const char ADD = '+';
-const char REMOVE = '-';
-const char SUBST = 'x';
-const char WILD = '%';
+    std::string file_path1 = files[0];
+    std::string file_path2 = files[1];
 
-struct Move {
-  char action;
-  int n;
-  std::string line;
-  Move() : n(-1) {}
-  Move(char action, int n, std::string line)
-      : action(action), n(n), line(line) {}
-};
+    if (options.approximate and options.budget.max_distance < 0 and
+        deadline < 0) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: --approximate requires --max-distance or "
+                   "--deadline\n";
+      return -1;
+    }
+    // counted from here, so it covers reading the files and the diff
+    if (deadline >= 0) {
+      options.budget.deadline =
+          Budget::Clock::now() + std::chrono::milliseconds(deadline);
+    }
+    // declared before every OutputBuffer, so it reports after they flush
+    Stats stats("diff", report);
+
+    std::unique_ptr<DiffCache> cache;
+    if (not cache_dir.empty()) {
+      std::error_code error;
+      std::filesystem::create_directories(cache_dir, error);
+      if (not std::filesystem::is_directory(cache_dir)) {
+        std::cout << "ERROR: cannot create the cache directory " << cache_dir
+                  << '\n';
+        return -1;
+      }
+      // everything that shapes the patch: --jobs only does through the
+      // memory auto allows itself
+      std::string key = algorithm + (linear_space ? " linear-space" : "") +
+                        (options.patience ? " patience" : "");
+      if (options.engine == auto_diff) {
+        key += " max-bytes=" + std::to_string(options.budget.max_bytes);
+      }
+      cache = std::make_unique<DiffCache>(cache_dir, key,
+                                          uint64_t(cache_size) << 20);
+    }
 
-std::vector<Move> edit_distance(std::vector<std::string> src,
-                                std::vector<std::string> dst) {
-  int m1 = src.size();
-  int m2 = dst.size();
+    if (recursive) {
+      for (const auto& path : {file_path1, file_path2}) {
+        if (not std::filesystem::is_directory(path)) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: " << path << " is not a directory\n";
+          return -1;
+        }
+      }
+      // the files are loaded, diffed and formatted by several threads at a
+      // time, so all of it is one phase
+      stats.phase("diff");
+      OutputBuffer output(stdout, flush_every, make_compressor(compression));
+      std::string failed, error;
+      if (not diff_trees(file_path1, file_path2, options, cache.get(), text,
+                         output, failed, error)) {
+        if (not error.empty()) {
+          std::cout << error << std::endl;
+          return 1;
+        }
+        std::cout << "ERROR: " << failed << " differs by more than the "
+                  << "budget allows\n";
+        return EXIT_TOO_DIFFERENT;
+      }
+      stats.phase("write");
+      stats.count("bytes_emitted", output.bytes_written());
+      return 0;
+    }
 
-  std::vector<std::vector<int>> distances(m1 + 1, std::vector<int>(m2 + 1, 0));
-  std::vector<std::vector<char>> actions(m1 + 1,
-                                         std::vector<char>(m2 + 1, WILD));
+    stats.phase("load");
+    if (quiet and same_contents(file_path1, file_path2)) return 0;
+    auto lines1 = read_entire_file(file_path1);
+    auto lines2 = read_entire_file(file_path2);
+    stats.count("src_lines", lines1.size());
+    stats.count("dst_lines", lines2.size());
+    if (quiet) return same_lines(lines1, lines2) ? 0 : EXIT_DIFFERENT;
+
+    // every engine finds as many changes, so --stat never builds a patch
+    if (stat) {
+      stats.phase("intern");
+      auto interned = intern_lines(lines1, lines2);
+      stats.phase("diff");
+      Scratch scratch;
+      std::vector<Region> regions;
+      DiffStat counts;
+      bool counted = count_spans(interned.src, interned.dst, interned.count,
+                                 options, scratch, regions, counts);
+      stats.count("cells", scratch.counters.cells);
+      if (not counted) {
+        std::cout << "ERROR: the files differ by more than the budget "
+                  << "allows\n";
+        return EXIT_TOO_DIFFERENT;
+      }
+      stats.count("edit_distance", counts.insertions + counts.deletions);
+      std::cout << counts.insertions << " insertions(+), " << counts.deletions
+                << " deletions(-)\n";
+      bool same = counts.insertions == 0 and counts.deletions == 0;
+      return same ? 0 : EXIT_DIFFERENT;
+    }
 
-  distances[0][0] = 0;
-  actions[0][0] = IGNORE;
+    bool within = true;
+    Scratch scratch;
+    auto patch = diff_files(lines1, lines2, options, cache.get(), scratch,
+                            within, &stats);
+    if (not within and not options.approximate) {
+      std::cout << "ERROR: the files differ by more than the budget allows\n";
+      return EXIT_TOO_DIFFERENT;
+    }
+    stats.count("edit_distance", patch.size());
+
+    stats.phase("write");
+    OutputBuffer output(stdout, flush_every, make_compressor(compression));
+    if (format == "bin") {
+      if (source_refs) {
+        auto interned = intern_lines(lines1, lines2);
+        write_binary_patch(output, patch, lines2, &interned);
+      } else {
+        write_binary_patch(output, patch, lines2, nullptr);
+      }
+    } else if (format == "unified") {
+      write_unified_patch(output, patch, lines1, lines2, text.context,
+                          file_path1, file_path2);
+    } else {
+      write_text_patch(output, patch, lines1, lines2, text);
+    }
+    stats.count("lines_emitted", output.lines_written());
+    stats.count("bytes_emitted", output.bytes_written());
 
-  for (int j = 1; j < 1 + m2; ++j) {
-    distances[0][j] = j;
-    actions[0][j] = ADD;
+    return 0;
   }
+};
 
-  for (int i = 1; i < 1 + m1; ++i) {
-    distances[i][0] = i;
-    actions[i][0] = REMOVE;
+// Applies `patch` to `src` in a single merge pass over both. REMOVE n names
+// line n of `src` and ADD n line n of the result, so removals and additions
+// only need to be ordered among themselves. Every removed line is checked
+// against `src`; on any mismatch the problems are reported to `log` and
+// false is returned.
+bool apply_patch(const LineFile& src, const std::string& src_path,
+                 const std::vector<Move>& patch,
+                 std::vector<std::string_view>& result,
+                 std::ostream& log = std::cout) {
+  std::vector<Move> removes, adds;
+  for (const auto& move : patch) {
+    (move.action == REMOVE ? removes : adds).push_back(move);
   }
+  auto by_line = [](const Move& p1, const Move& p2) { return p1.n < p2.n; };
+  std::stable_sort(removes.begin(), removes.end(), by_line);
+  std::stable_sort(adds.begin(), adds.end(), by_line);
+
+  bool ok = true;
+  result.clear();
+  result.reserve(src.size() + adds.size());
+
+  size_t r = 0, a = 0, i = 0;
+  while (true) {
+    if (a < adds.size() and adds[a].n <= (int)result.size()) {
+      if (adds[a].n < (int)result.size()) break;
+      result.push_back(adds[a++].line);
+      continue;
+    }
+    if (i == src.size()) break;
 
-  for (int i = 1; i < 1 + m1; ++i) {
-    for (int j = 1; j < 1 + m2; ++j) {
-      if (src[i - 1] == dst[j - 1]) {
-        distances[i][j] = distances[i - 1][j - 1];
-        actions[i][j] = IGNORE;
-
-        continue;
+    if (r < removes.size() and removes[r].n <= (int)i) {
+      if (removes[r].n < (int)i) break;
+      if (removes[r].line != src[i]) {
+        log << src_path << ":" << i + 1
+            << ": Removed line does not match: " << removes[r].line << '\n';
+        ok = false;
       }
+      r++, i++;
+      continue;
+    }
 
-      int remove = distances[i - 1][j];
-      int add = distances[i][j - 1];
-      // int subst = distances[i - 1][j - 1];
-
-      distances[i][j] = remove;
-      actions[i][j] = REMOVE;
+    result.push_back(src[i++]);
+  }
 
-      if (distances[i][j] > add) {
-        distances[i][j] = add;
-        actions[i][j] = ADD;
-      }
+  if (r < removes.size()) {
+    log << "ERROR: cannot remove line " << removes[r].n << " of " << src_path
+        << " (" << src.size() << " lines)\n";
+    return false;
+  }
+  if (a < adds.size()) {
+    log << "ERROR: cannot add line " << adds[a].n << " to " << src_path
+        << " (result has " << result.size() << " lines)\n";
+    return false;
+  }
 
-      // if (distances[i][j] > subst) {
-      //   distances[i][j] = subst;
-      //   actions[i][j] = SUBST;
-      // }
+  return ok;
+}
 
-      distances[i][j] += 1;
+// Reads every record of the (decompressed) text or binary `patch_file` of
+// `src` into `patch`, with blocks expanded. The lines of WORD_MOVE records
+// are kept in `lines`. Problems are reported to `log`; false if there were
+// any.
+bool read_patch(const LineFile& src, const std::string& src_path,
+                const LineFile& patch_file, const std::string& patch_path,
+                Arena& lines, std::vector<Move>& patch,
+                std::ostream& log = std::cout) {
+  bool binary =
+      patch_file.contents().substr(0, BINARY_MAGIC.size()) == BINARY_MAGIC;
+  if (binary) {
+    StreamReader input(patch_file.contents());
+    BinaryPatchReader reader(input, patch_path, &src);
+
+    Move record;
+    while (reader.next(record)) patch.push_back(record);
+    if (not reader.error.empty()) {
+      log << reader.error << '\n';
+      return false;
     }
+    return true;
   }
-  std::vector<Move> patch;
-  int i = m1, j = m2;
-  while (i > 0 or j > 0) {
-    char action = actions[i][j];
-    if (action == ADD) {
-      j--;
-      patch.push_back(Move(ADD, j, dst[j]));
-    } else if (action == REMOVE) {
-      i--;
-      patch.push_back(Move(REMOVE, i, src[i]));
-    } else if (action == IGNORE) {
-      i--, j--;  // patch.push_back(Move(IGNORE,src[i]));
+
+  bool ok = true;
+  std::string src_line, dst_line;
+  for (int row = 0; row < patch_file.size(); ++row) {
+    auto line = patch_file[row];
+    if (line.size() == 0) continue;
+
+    Move record, add;
+    Block block;
+    if (parse_move(line, record)) {
+      patch.push_back(record);
+    } else if (parse_block(line, block)) {
+      if (not expand_block(block, src, patch)) {
+        log << patch_path << ":" << row + 1 << ": Beyond the end of "
+            << src_path << ": " << line << '\n';
+        ok = false;
+      }
+    } else if (parse_word_move(line, record, add, src_line, dst_line)) {
+      record.line = lines.copy(src_line);
+      add.line = lines.copy(dst_line);
+      patch.push_back(record);
+      patch.push_back(add);
     } else {
-      assert(false && "Unreachable");
+      log << patch_path << ":" << row + 1
+          << ": Invalid patch action: " << line << '\n';
+      ok = false;
     }
   }
+  return ok;
+}
+
+// Streaming variant of apply_patch: `src` and the patch are both read one
+// line at a time and every result line is written to `outputs` as soon as it
+// is known. This needs the records in the order diff emits them, where
+// REMOVEs and ADDs each have increasing line numbers and every record
+// refers to a later point of the edit path than the one before it.
+bool stream_patch(StreamReader& src, const std::string& src_path,
+                  PatchReader& patch, std::vector<OutputBuffer*> outputs) {
+  auto emit = [&](std::string_view line) {
+    for (auto output : outputs) {
+      output->write(line);
+      output->end_line();
+    }
+  };
+
+  int i = 0, j = 0;  // src lines consumed, lines written
+  std::string_view current;
+  bool loaded = false;
+  auto load = [&]() {
+    if (not loaded) loaded = src.next_line(current);
+    return loaded;
+  };
+  auto copy_one = [&]() {
+    emit(current);
+    loaded = false;
+    i++, j++;
+  };
+
+  bool ok = true;
+  Move record;
+  while (patch.next(record)) {
+    int& position = record.action == REMOVE ? i : j;
+    if (record.n < position) {
+      std::cout << patch.location() << ": Out of order for --stream: "
+                << record.action << " " << record.n << '\n';
+      return false;
+    }
+    while (position < record.n and load()) copy_one();
+    if (position < record.n or (record.action == REMOVE and not load())) {
+      std::cout << patch.location() << ": Beyond the end of " << src_path
+                << ": " << record.action << " " << record.n << '\n';
+      return false;
+    }
 
-  std::reverse(patch.begin(), patch.end());
+    if (record.action == REMOVE) {
+      if (patch.removes_have_text and current != record.line) {
+        std::cout << src_path << ":" << i + 1
+                  << ": Removed line does not match: " << record.line
+                  << '\n';
+        ok = false;
+      }
+      loaded = false;
+      i++;
+    } else {
+      emit(record.line);
+      j++;
+    }
+  }
 
-  return patch;
-}
+  if (not patch.error.empty()) {
+    std::cout << patch.error << '\n';
+    return false;
+  }
 
-namespace ref {
-#define head(s) (s[0])
-#define tail(s) (std::string(s.begin() + 1, s.end()))
+  while (load()) copy_one();
 
-std::map<std::pair<std::string, std::string>, int> mp;
+  return ok;
+}
 
-int lev(std::string src, std::string dst) {
-  if (src.length() == 0) return dst.length();
-  if (dst.length() == 0) return src.length();
-  if (mp.count({src, dst})) return mp[{src, dst}];
-  if (head(src) == head(dst))
-    return mp[{src, dst}] = lev(tail(src), tail(dst));  // ignore
-  int dist = 1 + std::min({
-                     lev(tail(src), dst),       // remove
-                     lev(src, tail(dst)),       // add
-                     lev(tail(src), tail(dst))  // replace
-                 });
-  return mp[{src, dst}] = dist;
+// Whether `path`, from a tree patch, names a file inside the tree: relative,
+// without `..` components (or NULs, which would cut it short) and not the
+// tree itself. Anything else could read or write outside of it.
+bool inside_tree(const std::string& path) {
+  std::filesystem::path relative(path);
+  if (relative.empty() or relative.is_absolute() or
+      path.find('\0') != std::string::npos) {
+    return false;
+  }
+  for (const auto& part : relative) {
+    if (part == "..") return false;
+  }
+  auto normal = relative.lexically_normal();
+  return normal.has_filename() and normal != "." and *normal.begin() != "..";
 }
-};  // namespace ref
 
-class Subcommand {
- public:
-  std::string name;
-  std::string signature;
-  std::string description;
+// Applies a tree patch (see diff_trees) to the tree at `root` and writes the
+// patched tree to `result_root`: patched and new files are written, removed
+// ones left out and every file the patch does not mention copied as is.
+// Files whose records do not apply are reported and skipped, and the
+// result is then incomplete. A patch with a path outside the tree (see
+// inside_tree) is refused as a whole, before anything is read or written.
+bool patch_tree(const std::string& root, const std::string& result_root,
+                const std::string& patch_path, const LineFile& patch_file) {
+  struct Section {
+    char kind;  // IGNORE for a changed file, ADD or REMOVE for a new or
+                // removed one
+    std::string path;
+    std::vector<Move> moves;
+    std::vector<Block> blocks;  // expanded once the file is read
+  };
+  std::vector<Section> sections;
+  Arena lines;  // of WORD_MOVE records
+  std::string src_line, dst_line;
+
+  bool ok = true;
+  for (size_t row = 0; row < patch_file.size(); ++row) {
+    auto line = patch_file[row];
+    if (line.size() == 0) continue;
+
+    if (line.substr(0, TREE_HEADER.size()) == TREE_HEADER) {
+      line.remove_prefix(TREE_HEADER.size());
+      char kind = IGNORE;
+      if (not line.empty() and (line[0] == ADD or line[0] == REMOVE)) {
+        kind = line[0];
+        line.remove_prefix(1);
+      }
+      if (line.size() > 1 and line[0] == ' ') {
+        std::string path(line.substr(1));
+        if (not inside_tree(path)) {
+          std::cout << patch_path << ":" << row + 1
+                    << ": Path outside the tree: " << path << '\n';
+          ok = false;
+        }
+        sections.push_back({kind, path, {}, {}});
+        continue;
+      }
+    }
 
-  Subcommand(std::string name, std::string signature, std::string description)
-      : name(name), signature(signature), description(description) {}
-  virtual int run(std::string program, std::vector<std::string> args) {
-    assert(false && "Not implemented");
-    return 0;
+    Move record, add;
+    Block block;
+    if (not sections.empty() and parse_move(line, record)) {
+      sections.back().moves.push_back(record);
+    } else if (not sections.empty() and parse_block(line, block)) {
+      sections.back().blocks.push_back(block);
+    } else if (not sections.empty() and
+               parse_word_move(line, record, add, src_line, dst_line)) {
+      record.line = lines.copy(src_line);
+      add.line = lines.copy(dst_line);
+      sections.back().moves.push_back(record);
+      sections.back().moves.push_back(add);
+    } else {
+      std::string error = patch_path + ":" + std::to_string(row + 1) +
+                          ": Invalid patch action: " + std::string(line);
+      std::cout << error << '\n';
+      ok = false;
+    }
   }
-};
+  if (not ok) return false;
 
-std::vector<Subcommand*> SUBCOMMANDS;
+  std::vector<std::string> patched;
+  for (auto& [kind, path, moves, blocks] : sections) {
+    patched.push_back(path);
 
-void usage(std::string program) {
-  std::cout << "Usage: " << program << " <SUBCOMMAND> [OPTIONS]\n";
-  std::cout << "Subcommands:\n";
+    std::string src_path = root + "/" + path;
+    auto src = kind == ADD ? LineFile() : read_entire_file(src_path);
+    bool expanded = true;
+    for (const auto& block : blocks) {
+      expanded = expanded and expand_block(block, src, moves);
+    }
+    if (not expanded) {
+      std::cout << "ERROR: a block is beyond the end of " << src_path << '\n';
+      ok = false;
+      continue;
+    }
+    std::vector<std::string_view> result;
+    if (not apply_patch(src, src_path, moves, result)) {
+      ok = false;
+      continue;
+    }
+    if (kind == REMOVE) continue;
 
-  std::vector<int> lengths;
-  for (auto sub_cmd : SUBCOMMANDS) {
-    std::string str = sub_cmd->name + " " + sub_cmd->signature;
-    lengths.push_back(str.length());
+    std::string result_path = result_root + "/" + path;
+    std::filesystem::create_directories(
+        std::filesystem::path(result_path).parent_path());
+    write_to_file(result_path, result);
   }
 
-  int width = *std::max_element(lengths.begin(), lengths.end());
+  std::sort(patched.begin(), patched.end());
+  std::vector<std::string> paths;
+  std::string error;
+  if (not list_files(root, paths, error)) {
+    std::cout << error << '\n';
+    return false;
+  }
+  for (const auto& path : paths) {
+    if (std::binary_search(patched.begin(), patched.end(), path)) continue;
+
+    std::string result_path = result_root + "/" + path;
+    std::filesystem::create_directories(
+        std::filesystem::path(result_path).parent_path());
+    std::filesystem::copy_file(
+        root + "/" + path, result_path,
+        std::filesystem::copy_options::overwrite_existing);
+  }
 
-  for (auto sub_cmd : SUBCOMMANDS) {
-    std::string command = sub_cmd->name + " " + sub_cmd->signature;
+  return ok;
+}
 
-    std::cout << "\t" << std::setw(width) << command << "\t"
-              << sub_cmd->description << "\n";
-  }
+// A hash of `lines` in turn, to check a written file against.
+uint64_t hash_lines(const std::vector<std::string_view>& lines) {
+  uint64_t hash = 0;
+  for (auto line : lines) hash = hash_bytes(line, hash);
+  return hash;
 }
 
-class DiffSubcommand : public Subcommand {
+uint64_t hash_lines(const LineFile& file) {
+  uint64_t hash = 0;
+  for (size_t i = 0; i < file.size(); ++i) hash = hash_bytes(file[i], hash);
+  return hash;
+}
+
+class PatchSubcommand : public Subcommand {
  public:
-  DiffSubcommand()
-      : Subcommand("diff", "<file1> <file2>",
-                   "print the difference between the files to stdout") {}
+  PatchSubcommand()
+      : Subcommand("patch",
+                   "[--stream] [--flush-every N] [-r] [--stats] "
+                   "[--in-place | --output FILE] [--no-stdout] [--verify] "
+                   "<file> <file.patch>",
+                   "patch the file (or, with -r, the directory tree) with the "
+                   "given patch; the result goes to stdout and to _<file>, or "
+                   "with --output to FILE, or with --in-place over the file "
+                   "itself, always through a temporary file renamed once "
+                   "complete; --no-stdout skips stdout, --verify reads the "
+                   "result back and checks it before the rename; --stats "
+                   "reports the cost of every phase to stderr as JSON") {}
 
   int run(std::string program, std::vector<std::string> args) override {
-    if (args.size() < 2) {
-      std::string usage = "Usage: " + program + " " + name + " " + signature;
+    std::string usage = "Usage: " + program + " " + name + " " + signature;
+
+    int flush_every = 0;
+    bool stream = false;
+    bool recursive = false;
+    bool report = false;
+    bool in_place = false;
+    bool to_stdout = true;
+    bool verify = false;
+    std::string output_path;
+    std::vector<std::string> files;
+    for (size_t i = 0; i < args.size(); ++i) {
+      std::string arg = args[i];
+      std::string value;
+      if (arg == "--stream") {
+        stream = true;
+      } else if (arg == "-r") {
+        recursive = true;
+      } else if (arg == "--stats") {
+        report = true;
+      } else if (arg == "--in-place") {
+        in_place = true;
+      } else if (arg == "--no-stdout") {
+        to_stdout = false;
+      } else if (arg == "--verify") {
+        verify = true;
+      } else if (option_value(args, i, "--output", value)) {
+        output_path = value;
+      } else if (option_value(args, i, "--flush-every", value)) {
+        if (not parse_int(value, flush_every) or flush_every < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid line count " << value << '\n';
+          return -1;
+        }
+      } else if (arg.rfind("--", 0) == 0) {
+        std::cout << usage << '\n';
+        std::cout << "ERROR: unknown option " << arg << '\n';
+        return -1;
+      } else {
+        files.push_back(arg);
+      }
+    }
+
+    if (files.size() < 2) {
       std::string error = "ERROR: not enough files were provided to " + name;
 
       std::cout << usage << '\n';
@@ -198,109 +2784,672 @@ class DiffSubcommand : public Subcommand {
       return -1;
     }
 
-    std::string file_path1 = args[0];
-    std::string file_path2 = args[1];
+    std::string file_path = files[0];
+    std::string patch_path = files[1];
+
+    std::string conflict;
+    if (recursive and stream) {
+      conflict = "-r cannot be combined with --stream";
+    } else if (recursive and (in_place or not output_path.empty() or
+                              not to_stdout or verify)) {
+      conflict = "-r cannot be combined with --in-place, --output, "
+                 "--no-stdout or --verify";
+    } else if (in_place and not output_path.empty()) {
+      conflict = "--in-place cannot be combined with --output";
+    } else if (stream and verify) {
+      conflict = "--verify cannot be combined with --stream";
+    }
+    if (not conflict.empty()) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: " << conflict << '\n';
+      return -1;
+    }
+
+    Stats stats("patch", report);
+    if (recursive) {
+      if (not std::filesystem::is_directory(file_path)) {
+        std::cout << usage << '\n';
+        std::cout << "ERROR: " << file_path << " is not a directory\n";
+        return -1;
+      }
+      stats.phase("load");
+      auto patch_file = read_entire_file(patch_path);
+      std::string error;
+      if (not decompress_file(patch_file, patch_path, error)) {
+        std::cout << "ERROR: " << patch_path << ": " << error << '\n';
+        return -1;
+      }
+      while (file_path.size() > 1 and file_path.back() == '/') {
+        file_path.pop_back();
+      }
+      // every file is read, patched and written in turn
+      stats.phase("apply");
+      return patch_tree(file_path, "_" + file_path, patch_path, patch_file)
+                 ? 0
+                 : -1;
+    }
 
-    auto lines1 = read_entire_file(file_path1);
-    auto lines2 = read_entire_file(file_path2);
+    // the result keeps the mode of the file it replaces
+    std::string target = in_place              ? file_path
+                         : output_path.empty() ? "_" + file_path
+                                               : output_path;
+    mode_t mode = 0666 & ~current_umask();
+    struct stat status;
+    if (in_place and stat(file_path.c_str(), &status) == 0) {
+      mode = status.st_mode & 07777;
+    }
+    TempFile temp;
+
+    if (stream) {
+      stats.phase("load");
+      StreamReader src(file_path);
+      StreamReader input(patch_path);
+      std::string error;
+      if (not input.decompress(error)) {
+        std::cout << "ERROR: " << patch_path << ": " << error << '\n';
+        return -1;
+      }
+
+      std::unique_ptr<PatchReader> patch;
+      if (input.peek(BINARY_MAGIC.size()) == BINARY_MAGIC) {
+        patch = std::make_unique<BinaryPatchReader>(input, patch_path, nullptr);
+      } else {
+        patch = std::make_unique<TextPatchReader>(input, patch_path);
+      }
+
+      if (not temp.open(target, mode, error)) {
+        std::cout << error << std::endl;
+        return -1;
+      }
+
+      // the patch is parsed and applied as the result is written
+      stats.phase("apply");
+      bool ok;
+      {
+        OutputBuffer output(stdout, flush_every);
+        OutputBuffer copy(temp.stream());
+        std::vector<OutputBuffer*> outputs = {&copy};
+        if (to_stdout) outputs.insert(outputs.begin(), &output);
+        ok = stream_patch(src, file_path, *patch, outputs);
+        stats.count("lines_emitted", copy.lines_written());
+      }
+      if (ok and not temp.commit(in_place, error)) {
+        std::cout << error << std::endl;
+        return -1;
+      }
+
+      return ok ? 0 : -1;
+    }
+
+    stats.phase("load");
+    auto lines1 = read_entire_file(file_path);
+    auto lines2 = read_entire_file(patch_path);
+    std::string error;
+    if (not decompress_file(lines2, patch_path, error)) {
+      std::cout << "ERROR: " << patch_path << ": " << error << '\n';
+      return -1;
+    }
+    stats.count("src_lines", lines1.size());
+
+    stats.phase("parse");
+    std::vector<Move> patch;
+    Arena lines;
+    if (not read_patch(lines1, file_path, lines2, patch_path, lines, patch)) {
+      return -1;
+    }
+    stats.count("records", patch.size());
+
+    stats.phase("apply");
+    std::vector<std::string_view> result;
+    if (not apply_patch(lines1, file_path, patch, result)) {
+      return -1;
+    }
 
-    auto patch = edit_distance(lines1, lines2);
+    stats.phase("write");
+    // --verify hashes the result while it is written
+    uint64_t expected = 0;
+    std::thread hasher;
+    if (verify) hasher = std::thread([&] { expected = hash_lines(result); });
+
+    if (to_stdout) {
+      OutputBuffer output(stdout, flush_every);
+      for (auto line : result) {
+        output.write(line);
+        output.end_line();
+      }
+    }
+    stats.count("lines_emitted", result.size());
+
+    bool ok = temp.open(target, mode, error);
+    if (ok and not write_lines(fileno(temp.stream()), result)) {
+      error = "Error: writing the file " + temp.path();
+      ok = false;
+    }
+    if (hasher.joinable()) hasher.join();
+    if (not ok) {
+      std::cout << error << std::endl;
+      return -1;
+    }
 
-    for (auto [action, n, line] : patch) {
-      std::string str;
-      str.append(std::string(1, action));
-      str.append(" ");
-      str.append(std::to_string(n));
-      str.append(" ");
-      str.append(line);
+    if (verify) {
+      stats.phase("verify");
+      LineFile written;
+      if (not read_file(temp.path(), written, error) or
+          hash_lines(written) != expected) {
+        std::cout << "ERROR: " << temp.path()
+                  << " does not read back as written, " << target
+                  << " is left as it was\n";
+        return -1;
+      }
+    }
 
-      std::cout << str << std::endl;
+    if (not temp.commit(in_place, error)) {
+      std::cout << error << std::endl;
+      return -1;
     }
 
     return 0;
   }
 };
 
-std::regex pattern(R"(([AR]) (\d+) ( *.*))");
+// Exit code of `merge` when there are conflicts.
+const int EXIT_CONFLICTS = 1;
 
-class PatchSubcommand : public Subcommand {
+class MergeSubcommand : public Subcommand {
  public:
-  PatchSubcommand()
-      : Subcommand("patch", "<file> <file.patch>",
-                   "patch the file with the given patch") {}
+  MergeSubcommand()
+      : Subcommand("merge",
+                   "[--algorithm=myers|dp|bitparallel|auto] "
+                   "[--linear-space] [--patience] [--diff3] <base> <ours> "
+                   "<theirs>",
+                   "merge the changes from base to ours and to theirs and "
+                   "print the result to stdout, with conflict markers where "
+                   "they clash (and, with --diff3, the base lines too); "
+                   "exits with 1 if there are conflicts") {}
 
   int run(std::string program, std::vector<std::string> args) override {
-    if (args.size() < 2) {
-      std::string usage = "Usage: " + program + " " + name + " " + signature;
-      std::string error = "ERROR: not enough files were provided to " + name;
+    std::string usage = "Usage: " + program + " " + name + " " + signature;
+
+    std::string algorithm = "myers";
+    bool linear_space = false;
+    DiffOptions options;
+    bool diff3 = false;
+    std::vector<std::string> files;
+    for (size_t i = 0; i < args.size(); ++i) {
+      std::string arg = args[i];
+      if (arg.rfind("--algorithm=", 0) == 0) {
+        algorithm = arg.substr(arg.find('=') + 1);
+      } else if (arg == "--linear-space") {
+        linear_space = true;
+      } else if (arg == "--patience") {
+        options.patience = true;
+      } else if (arg == "--diff3") {
+        diff3 = true;
+      } else if (arg.rfind("--", 0) == 0) {
+        std::cout << usage << '\n';
+        std::cout << "ERROR: unknown option " << arg << '\n';
+        return -1;
+      } else {
+        files.push_back(arg);
+      }
+    }
 
+    std::string error;
+    if (not select_engine(algorithm, linear_space, options, error)) {
       std::cout << usage << '\n';
-      std::cout << error << '\n';
+      std::cout << "ERROR: " << error << '\n';
+      return -1;
+    }
 
+    if (files.size() < 3) {
+      std::cout << usage << '\n';
+      std::cout << "ERROR: not enough files were provided to " << name
+                << '\n';
       return -1;
     }
 
-    std::string file_path = args[0];
-    std::string patch_path = args[1];
+    auto base = read_entire_file(files[0]);
+    auto ours = read_entire_file(files[1]);
+    auto theirs = read_entire_file(files[2]);
+
+    // one interner for all three, so the base is hashed once
+    LineInterner interner;
+    auto base_ids = intern_file(interner, base);
+    auto ours_ids = intern_file(interner, ours);
+    auto theirs_ids = intern_file(interner, theirs);
+    uint32_t count = interner.count();
+
+    std::vector<Move> to_ours, to_theirs;
+    auto diff = [&](const std::vector<uint32_t>& side,
+                    std::vector<Move>& patch) {
+      Scratch scratch;
+      std::vector<Region> regions;
+      diff_spans(base_ids, side, count, options, scratch, regions, patch);
+    };
+    std::atomic<bool> out_of_memory = false;
+    std::thread worker([&] {
+      try {
+        diff(ours_ids, to_ours);
+      } catch (const std::bad_alloc&) {
+        out_of_memory = true;
+      }
+    });
+    try {
+      diff(theirs_ids, to_theirs);
+    } catch (const std::bad_alloc&) {
+      out_of_memory = true;
+    }
+    worker.join();
+    if (out_of_memory) throw std::bad_alloc();
+
+    std::vector<MergeRegion> regions;
+    int conflicts = merge3(base_ids, ours_ids, theirs_ids, to_ours,
+                           to_theirs, regions);
+
+    OutputBuffer output(stdout);
+    auto lines = [&](const LineFile& file, int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        output.write(file[i]);
+        output.end_line();
+      }
+    };
+    auto marker = [&](const char* text, const std::string& label) {
+      output.write(std::string_view(text));
+      if (not label.empty()) {
+        output.write(' ');
+        output.write(label);
+      }
+      output.end_line();
+    };
+    for (const auto& region : regions) {
+      switch (region.kind) {
+        case KEEP:
+          lines(base, region.base_begin, region.base_end);
+          break;
+        case OURS:
+        case BOTH:
+          lines(ours, region.ours_begin, region.ours_end);
+          break;
+        case THEIRS:
+          lines(theirs, region.theirs_begin, region.theirs_end);
+          break;
+        case CONFLICT:
+          marker("<<<<<<<", files[1]);
+          lines(ours, region.ours_begin, region.ours_end);
+          if (diff3) {
+            marker("|||||||", files[0]);
+            lines(base, region.base_begin, region.base_end);
+          }
+          marker("=======", "");
+          lines(theirs, region.theirs_begin, region.theirs_end);
+          marker(">>>>>>>", files[2]);
+          break;
+      }
+    }
+    return conflicts > 0 ? EXIT_CONFLICTS : 0;
+  }
+};
 
-    auto lines1 = read_entire_file(file_path);
-    auto lines2 = read_entire_file(patch_path);
+// `cdiff batch` runs many diffs and patches in one process, so callers with
+// thousands of small ones start cdiff once. A job is a header line, then
+// the contents it has inline:
+//
+//   <id> diff [--algorithm=A] [--linear-space] [--patience]
+//        [--max-distance D] [--deadline MS] [--approximate]
+//        [--format=text|bin|unified] [-U N] [--word-diff] [--detect-moves]
+//        <src> <dst>
+//   <id> patch <src> <patch>
+//
+// Each operand is a path, or :N for N bytes that follow the header, in the
+// order of the operands. Every job is answered as soon as it is done with
+//
+//   <id> <status> <length>\n<length bytes>
+//
+// the exit status and stdout its subcommand would have had, where for patch
+// those are the patched file. A header that cannot be read ends the input,
+// as there is no telling where the next one starts.
+struct BatchJob {
+  std::string id;
+  std::string command;
+  std::vector<std::string> options;
+  std::string names[2];  // of the operands, "a" and "b" when inline
+  LineFile files[2];
+  bool inline_files[2] = {false, false};
+};
 
-    bool ok = true;
+// Runs `job` with `scratch`, putting what its subcommand would have written
+// to stdout in `output`. Returns the exit status.
+int run_batch_job(BatchJob& job, Scratch& scratch, std::string& output) {
+  auto fail = [&](const std::string& error) {
+    output = error + '\n';
+    return -1;
+  };
+  for (int k = 0; k < 2; ++k) {
+    std::string error;
+    if (not job.inline_files[k] and
+        not read_file(job.names[k], job.files[k], error)) {
+      return fail(error);
+    }
+  }
+  const LineFile& src = job.files[0];
+
+  if (job.command == "patch") {
+    if (not job.options.empty()) {
+      return fail("ERROR: unknown option " + job.options[0]);
+    }
+    LineFile& patch_file = job.files[1];
+    std::string error;
+    if (not decompress_file(patch_file, job.names[1], error)) {
+      return fail("ERROR: " + job.names[1] + ": " + error);
+    }
+    std::ostringstream log;
     std::vector<Move> patch;
+    Arena lines;
+    std::vector<std::string_view> result;
+    if (not read_patch(src, job.names[0], patch_file, job.names[1], lines,
+                       patch, log) or
+        not apply_patch(src, job.names[0], patch, result, log)) {
+      output = log.str();
+      return -1;
+    }
+    output.clear();
+    for (auto line : result) {
+      output.append(line);
+      output.push_back('\n');
+    }
+    return 0;
+  }
 
-    for (int row = 0; row < lines2.size(); ++row) {
-      auto line = lines2[row];
-      if (line.size() == 0) continue;
+  const LineFile& dst = job.files[1];
+  const auto& args = job.options;
+  std::string algorithm = "myers";
+  bool linear_space = false;
+  DiffOptions options;
+  int deadline = -1;
+  std::string format = "text";
+  int context = -1;
+  TextOptions text;
+  for (size_t i = 0; i < args.size(); ++i) {
+    const std::string& arg = args[i];
+    std::string value;
+    if (arg.rfind("--algorithm=", 0) == 0) {
+      algorithm = arg.substr(arg.find('=') + 1);
+    } else if (arg == "--linear-space") {
+      linear_space = true;
+    } else if (arg == "--patience") {
+      options.patience = true;
+    } else if (option_value(args, i, "--max-distance", value)) {
+      if (not parse_int(value, options.budget.max_distance) or
+          options.budget.max_distance < 0) {
+        return fail("ERROR: invalid distance " + value);
+      }
+    } else if (option_value(args, i, "--deadline", value)) {
+      if (not parse_int(value, deadline) or deadline < 0) {
+        return fail("ERROR: invalid deadline " + value);
+      }
+    } else if (arg == "--approximate") {
+      options.approximate = true;
+    } else if (option_value(args, i, "--format", value)) {
+      format = value;
+    } else if (option_value(args, i, "-U", value) or
+               (arg.rfind("-U", 0) == 0 and arg.size() > 2)) {
+      if (value.empty()) value = arg.substr(2);
+      if (not parse_int(value, context) or context < 0) {
+        return fail("ERROR: invalid number of context lines " + value);
+      }
+    } else if (arg == "--word-diff") {
+      text.word_diff = true;
+    } else if (arg == "--detect-moves") {
+      text.detect_moves = true;
+    } else {
+      return fail("ERROR: unknown option " + arg);
+    }
+  }
 
-      std::istringstream iss(line);
+  std::string error;
+  if (not select_engine(algorithm, linear_space, options, error)) {
+    return fail("ERROR: " + error);
+  }
+  if (format != "text" and format != "bin" and format != "unified") {
+    return fail("ERROR: unknown format " + format);
+  }
+  if (context >= 0 and format != "unified") {
+    return fail("ERROR: -U requires --format=unified");
+  }
+  if (format == "unified") text.context = context < 0 ? 3 : context;
+  if ((text.word_diff or text.detect_moves) and format != "text") {
+    return fail("ERROR: --word-diff and --detect-moves require --format=text");
+  }
+  if (options.approximate and options.budget.max_distance < 0 and
+      deadline < 0) {
+    return fail("ERROR: --approximate requires --max-distance or --deadline");
+  }
+  if (deadline >= 0) {
+    options.budget.deadline =
+        Budget::Clock::now() + std::chrono::milliseconds(deadline);
+  }
 
-      Move record;
+  bool within = true;
+  auto patch = diff_files(src, dst, options, nullptr, scratch, within);
+  if (not within and not options.approximate) {
+    output = "ERROR: the files differ by more than the budget allows\n";
+    return EXIT_TOO_DIFFERENT;
+  }
 
-      iss >> record.action;
-      iss >> record.n;
+  char* bytes = nullptr;
+  size_t size = 0;
+  FILE* file = open_memstream(&bytes, &size);
+  {
+    OutputBuffer buffer(file, 0, nullptr, 1 << 16);
+    if (format == "bin") {
+      write_binary_patch(buffer, patch, dst, nullptr);
+    } else if (format == "unified") {
+      write_unified_patch(buffer, patch, src, dst, text.context,
+                          job.names[0], job.names[1]);
+    } else {
+      write_text_patch(buffer, patch, src, dst, text);
+    }
+  }
+  fclose(file);
+  output.assign(bytes, size);
+  free(bytes);
+  return 0;
+}
 
-      if (record.action != ADD and record.action != REMOVE and record.n != -1) {
-        std::string error = patch_path + ":" + std::to_string(row + 1) +
-                            ": Invalid patch action: " + line;
-        std::cout << error << '\n';
-        ok = false;
-        continue;
-      }
+// Where the answers of one input go, whole and one at a time. Once a write
+// fails, say because the peer went away, the rest are dropped.
+class BatchAnswers {
+ public:
+  explicit BatchAnswers(int fd) : fd(fd) {}
 
-      std::getline(iss, record.line);
-      if (record.line[0] == ' ') record.line.erase(record.line.begin());
-      patch.push_back(record);
+  void send(const std::string& id, int status, const std::string& body) {
+    std::string header = id + " " + std::to_string(status) + " " +
+                         std::to_string(body.size()) + "\n";
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = failed or not put(header) or not put(body);
+  }
+
+ private:
+  bool put(std::string_view bytes) {
+    while (not bytes.empty()) {
+      ssize_t count = ::write(fd, bytes.data(), bytes.size());
+      if (count < 0 and errno == EINTR) continue;
+      if (count <= 0) return false;
+      bytes.remove_prefix(count);
     }
+    return true;
+  }
 
-    if (not ok) {
-      return -1;
+  int fd;
+  std::mutex mutex;
+  bool failed = false;
+};
+
+// Reads the jobs of `input` and runs them on `pool`, at most `limit` at a
+// time, answering each on `answers`. Returns once all are answered.
+void serve_batch(StreamReader& input, BatchAnswers& answers,
+                 ThreadPool& pool, size_t limit) {
+  std::mutex mutex;
+  std::condition_variable changed;
+  size_t running = 0;
+
+  // an input that cannot be read is over, like one that ends
+  std::string_view header;
+  auto next_header = [&] {
+    try {
+      return input.next_line(header);
+    } catch (const ReadError&) {
+      return false;
+    }
+  };
+  while (next_header()) {
+    // reading the inline operands refills the buffer `header` points into
+    std::string line(header);
+    std::vector<std::string> words;
+    std::stringstream stream{line};
+    for (std::string word; stream >> word;) words.push_back(word);
+    if (words.empty()) continue;
+
+    auto job = std::make_shared<BatchJob>();
+    job->id = words[0];
+    bool readable = words.size() >= 4 and
+                    (words[1] == "diff" or words[1] == "patch");
+    for (int k = 0; readable and k < 2; ++k) {
+      const std::string& operand = words[words.size() - 2 + k];
+      job->names[k] = operand;
+      if (operand[0] != ':') continue;
+      int size;
+      std::string_view bytes;
+      try {
+        readable = parse_int(operand.substr(1), size) and size >= 0 and
+                   input.read(size, bytes);
+      } catch (const ReadError&) {
+        readable = false;
+      }
+      if (not readable) break;
+      job->names[k] = k == 0 ? "a" : "b";
+      job->files[k] = LineFile(std::string(bytes));
+      job->inline_files[k] = true;
+    }
+    if (not readable) {
+      answers.send(job->id, -1,
+                   "ERROR: invalid job " + line + "\n");
+      break;
     }
+    job->command = words[1];
+    job->options.assign(words.begin() + 2, words.end() - 2);
 
-    std::sort(patch.begin(), patch.end(), [](auto p1, auto p2) {
-      if (p1.n == p2.n) return p1.action < p2.action;
-      return p1.n < p2.n;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&] { return running < limit; });
+      running++;
+    }
+    pool.submit([&, job] {
+      thread_local Scratch scratch;
+      std::string output;
+      int status;
+      try {
+        status = run_batch_job(*job, scratch, output);
+      } catch (const std::bad_alloc&) {
+        status = -1;
+        output = "ERROR: out of memory\n";
+      } catch (const ReadError& error) {
+        status = -1;
+        output = std::string(error.what()) + "\n";
+      }
+      answers.send(job->id, status, output);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      running--;
+      changed.notify_all();
     });
+  }
 
-    std::reverse(patch.begin(), patch.end());
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [&] { return running == 0; });
+}
+
+class BatchSubcommand : public Subcommand {
+ public:
+  BatchSubcommand()
+      : Subcommand("batch", "[--jobs N] [--socket PATH]",
+                   "run the diff and patch jobs read from stdin, or with "
+                   "--socket from every connection to a Unix socket, and "
+                   "answer each when it is done") {}
 
-    for (auto [action, row, line] : patch) {
-      if (action == REMOVE) {
-        lines1.erase(lines1.begin() + row);
-      } else if (action == ADD) {
-        lines1.insert(lines1.begin() + row, line);
+  int run(std::string program, std::vector<std::string> args) override {
+    std::string usage = "Usage: " + program + " " + name + " " + signature;
+
+    int jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string socket_path;
+    for (size_t i = 0; i < args.size(); ++i) {
+      std::string value;
+      if (option_value(args, i, "--jobs", value)) {
+        if (not parse_int(value, jobs) or jobs < 0) {
+          std::cout << usage << '\n';
+          std::cout << "ERROR: invalid number of jobs " << value << '\n';
+          return -1;
+        }
+        if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+      } else if (option_value(args, i, "--socket", value)) {
+        socket_path = value;
       } else {
-        assert(false && "unreachable");
+        std::cout << usage << '\n';
+        std::cout << "ERROR: unknown option " << args[i] << '\n';
+        return -1;
       }
     }
 
-    for (auto line : lines1) {
-      std::cout << line << std::endl;
+    // enough read ahead to keep every thread busy
+    ThreadPool pool(jobs);
+    size_t limit = 4 * size_t(jobs);
+
+    if (socket_path.empty()) {
+      StreamReader input(STDIN_FILENO, "stdin");
+      BatchAnswers answers(STDOUT_FILENO);
+      serve_batch(input, answers, pool, limit);
+      return 0;
     }
 
-    write_to_file("_" + file_path, lines1);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      std::cout << "ERROR: the socket path " << socket_path
+                << " is too long\n";
+      return -1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    // a socket left behind by an earlier server
+    struct stat info;
+    if (lstat(socket_path.c_str(), &info) == 0 and S_ISSOCK(info.st_mode)) {
+      unlink(socket_path.c_str());
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 or
+        bind(server, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) < 0 or
+        listen(server, 64) < 0) {
+      std::cout << "ERROR: cannot listen on " << socket_path << ": "
+                << strerror(errno) << '\n';
+      return -1;
+    }
 
-    return 0;
+    // a client that leaves early must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    while (true) {
+      int client = accept(server, nullptr, nullptr);
+      if (client < 0) {
+        if (errno == EINTR or errno == ECONNABORTED) continue;
+        std::cout << "ERROR: accepting on " << socket_path << ": "
+                  << strerror(errno) << '\n';
+        return -1;
+      }
+      std::thread([client, &pool, limit] {
+        StreamReader input(client, "socket");
+        BatchAnswers answers(client);
+        serve_batch(input, answers, pool, limit);
+      }).detach();
+    }
   }
 };
 
@@ -315,8 +3464,9 @@ Subcommand* find_subcommand(std::string sub_cmd_name) {
 
 void suggest_closet_subcommand_if_exists(std::string sub_cmd_name) {
   std::vector<std::string> candidates;
+  Scratch scratch;
   for (auto sub_cmd : SUBCOMMANDS) {
-    if (ref::lev(sub_cmd_name, sub_cmd->name) < 3) {
+    if (levenshtein(sub_cmd_name, sub_cmd->name, 2, scratch) <= 2) {
       candidates.push_back(sub_cmd->name);
     }
   }
@@ -361,8 +3511,13 @@ class HelpSubcommand : public Subcommand {
 int32_t main(int argc, char** argv) {
   assert(argc > 0 && "No Arguments");
 
-  SUBCOMMANDS = {new DiffSubcommand(), new PatchSubcommand(),
-                 new HelpSubcommand()};
+  // static, so they outlive SUBCOMMANDS and leak checkers find them freed
+  static DiffSubcommand diff;
+  static PatchSubcommand patch;
+  static MergeSubcommand merge;
+  static BatchSubcommand batch;
+  static HelpSubcommand help;
+  SUBCOMMANDS = {&diff, &patch, &merge, &batch, &help};
 
   std::string program = argv[0];
   std::vector<std::string> args(argv + 1, argv + argc);
@@ -380,7 +3535,17 @@ int32_t main(int argc, char** argv) {
   auto sub_cmd = find_subcommand(sub_cmd_name);
 
   if (sub_cmd) {
-    return sub_cmd->run(program, args);
+    try {
+      return sub_cmd->run(program, args);
+    } catch (const ReadError& error) {
+      std::cout << error.what() << std::endl;
+      return 1;
+    } catch (const std::bad_alloc&) {
+      // most likely the trace of a plain Myers diff of very different files
+      std::cout << "ERROR: out of memory, --linear-space or --max-distance "
+                   "make diff use less\n";
+      return -1;
+    }
   }
 
   usage(program);
@@ -0,0 +1,1915 @@
+// libcdiff: the diff engine behind cdiff, as a header-only library.
+//
+// Lines go in as string_views (or already interned ids) and the edit script
+// comes out through a MoveSink, in the order `cdiff diff` prints it. The
+// script is not streamed: it is built whole in the DiffContext and handed to
+// the sink once it is known to be within budget, so a sink never sees part
+// of a patch that is then called off. Errors are returned as a Status,
+// nothing here exits or throws. A DiffContext holds every buffer a diff
+// needs; keeping one per thread and passing it to each call means that,
+// once its buffers have grown to fit, diffing with jobs = 1 does not
+// allocate.
+//
+//   cdiff::DiffContext context;
+//   cdiff::Status status = cdiff::diff(src, src_size, dst, dst_size,
+//                                      cdiff::DiffOptions(), context, sink);
+
+#ifndef LIBCDIFF_H
+#define LIBCDIFF_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace cdiff {
+
+const char IGNORE = '=';
+const char ADD = '+';
+const char REMOVE = '-';
+const char SUBST = 'x';
+const char WILD = '%';
+
+struct Move {
+  char action;
+  int n;
+  std::string_view line;
+  Move() : n(-1) {}
+  Move(char action, int n) : action(action), n(n) {}
+  Move(char action, int n, std::string_view line)
+      : action(action), n(n), line(line) {}
+};
+
+// A window of interned lines, `offset` is the index of data[0] in its file.
+struct LineSpan {
+  const uint32_t* data;
+  int length;
+  int offset;
+
+  LineSpan(const std::vector<uint32_t>& lines)
+      : data(lines.data()), length(lines.size()), offset(0) {}
+  LineSpan(const uint32_t* data, int length, int offset)
+      : data(data), length(length), offset(offset) {}
+
+  int size() const { return length; }
+  uint32_t operator[](int i) const { return data[i]; }
+  LineSpan sub(int begin, int end) const {
+    return LineSpan(data + begin, end - begin, offset + begin);
+  }
+};
+
+struct PatienceSlot {
+  int src_count = 0;
+  int dst_count = 0;
+  int src_index = 0;
+};
+
+// What the engines did, for profiling.
+struct EngineCounters {
+  // DP cells computed: a cell of edit_distance, a frontier entry of the
+  // greedy searches or a bit of the bit-parallel columns
+  uint64_t cells = 0;
+  // regions auto_diff gave to each engine, and those it gave to a second
+  // one after the first went over what it was allowed
+  uint64_t dp = 0, myers = 0, bit_parallel = 0, linear_space = 0;
+  uint64_t switched = 0;
+
+  EngineCounters& operator+=(const EngineCounters& other) {
+    cells += other.cells;
+    dp += other.dp;
+    myers += other.myers;
+    bit_parallel += other.bit_parallel;
+    linear_space += other.linear_space;
+    switched += other.switched;
+    return *this;
+  }
+};
+
+// Memory the engines and the patience pass reuse from one call to the next,
+// grouped by who uses it. It only ever grows.
+struct Scratch {
+  std::vector<int> distances;  // edit_distance
+  std::vector<char> actions;
+  std::vector<int> trace;  // myers_diff
+  std::vector<int> forward, backward;  // myers_linear_diff
+  std::vector<int> first, positions, fill;  // bit_parallel_diff
+  std::vector<uint64_t> columns, match;
+  std::vector<PatienceSlot> slots;  // patience_regions
+  std::vector<std::pair<int, int>> pairs, anchors;
+  std::vector<int> piles, previous;
+  std::vector<int> row;  // levenshtein
+  std::vector<uint64_t> seen;  // auto_diff
+  EngineCounters counters;
+};
+
+// How much a diff may cost before the engine gives up on it.
+struct Budget {
+  using Clock = std::chrono::steady_clock;
+
+  int max_distance = -1;  // most moves a diff may have, -1 for any number
+  Clock::time_point deadline = Clock::time_point::max();
+  // memory auto_diff may give an engine's tables, 0 for any amount
+  uint64_t max_bytes = 0;
+
+  bool over(long distance) const {
+    return max_distance >= 0 and distance > max_distance;
+  }
+  bool expired() const {
+    return deadline != Clock::time_point::max() and Clock::now() > deadline;
+  }
+};
+
+// Every engine appends the edit script turning `src` into `dst` to `patch`
+// in path order, with Move::n relative to the start of the files. An engine
+// that finds the script would be longer than `budget` allows, or runs past
+// its deadline, returns false and leaves `patch` as it found it.
+using Engine = bool (*)(LineSpan src, LineSpan dst, std::vector<Move>& patch,
+                        Scratch& scratch, const Budget& budget);
+
+inline bool edit_distance(LineSpan src, LineSpan dst, std::vector<Move>& patch,
+                          Scratch& scratch, const Budget& budget) {
+  int m1 = src.size();
+  int m2 = dst.size();
+  if (budget.over(std::abs(m1 - m2))) return false;
+
+  // A path of at most `band` moves never leaves the diagonals |i - j| <=
+  // band, so with a max distance only that band of each row is filled in:
+  // row i keeps the `width` cells from column first(i) on. Cells outside it
+  // count as unreachable, which cannot change a distance within the band.
+  int band = std::max(m1, m2);
+  if (budget.max_distance >= 0) band = std::min(band, budget.max_distance);
+  size_t width = std::min<size_t>(m2 + 1, 2 * size_t(band) + 1);
+  auto first = [&](int i) {
+    return std::clamp<int>(i - band, 0, m2 + 1 - width);
+  };
+  auto cell = [&](int i, int j) { return i * width + (j - first(i)); };
+  auto inside = [&](int i, int j) {
+    return j >= first(i) and j < first(i) + int(width);
+  };
+  const int unreachable = std::numeric_limits<int>::max() - 1;
+
+  auto& distances = scratch.distances;
+  auto& actions = scratch.actions;
+  distances.assign((m1 + 1) * width, 0);
+  actions.assign((m1 + 1) * width, WILD);
+
+  distances[0] = 0;
+  actions[0] = IGNORE;
+
+  for (int j = 1; j < int(width); ++j) {
+    distances[j] = j;
+    actions[j] = ADD;
+  }
+
+  for (int i = 1; i < 1 + m1; ++i) {
+    if (budget.expired()) return false;
+    scratch.counters.cells += width;
+    for (int j = first(i); j < first(i) + int(width); ++j) {
+      size_t here = cell(i, j);
+      if (j == 0) {
+        distances[here] = i;
+        actions[here] = REMOVE;
+        continue;
+      }
+      if (src[i - 1] == dst[j - 1] and inside(i - 1, j - 1)) {
+        distances[here] = distances[cell(i - 1, j - 1)];
+        actions[here] = IGNORE;
+
+        continue;
+      }
+
+      int remove = inside(i - 1, j) ? distances[cell(i - 1, j)] : unreachable;
+      int add = inside(i, j - 1) ? distances[here - 1] : unreachable;
+      // int subst = distances[cell(i - 1, j - 1)];
+
+      distances[here] = remove;
+      actions[here] = REMOVE;
+
+      if (distances[here] > add) {
+        distances[here] = add;
+        actions[here] = ADD;
+      }
+
+      // if (distances[here] > subst) {
+      //   distances[here] = subst;
+      //   actions[here] = SUBST;
+      // }
+
+      distances[here] = std::min(distances[here] + 1, unreachable);
+    }
+  }
+  // the distance is the number of moves, so the backtrace can fill them in
+  // from the back instead of appending and reversing
+  int distance = distances[cell(m1, m2)];
+  if (budget.over(distance)) return false;
+  size_t next = patch.size() + distance;
+  patch.resize(next);
+  int i = m1, j = m2;
+  while (i > 0 or j > 0) {
+    char action = actions[cell(i, j)];
+    if (action == ADD) {
+      j--;
+      patch[--next] = Move(ADD, dst.offset + j);
+    } else if (action == REMOVE) {
+      i--;
+      patch[--next] = Move(REMOVE, src.offset + i);
+    } else if (action == IGNORE) {
+      i--, j--;  // patch.push_back(Move(IGNORE,src[i]));
+    } else {
+      assert(false && "Unreachable");
+    }
+  }
+  return true;
+}
+
+inline bool myers_linear_diff(LineSpan src, LineSpan dst,
+                              std::vector<Move>& patch, Scratch& scratch,
+                              const Budget& budget);
+
+// Myers' greedy O((N+M)D) algorithm.
+//
+// For every d the furthest reaching x of each diagonal k = x - y is kept
+// (clamped to the grid). Since the distance never decreases along a
+// diagonal, D(i, j) <= d holds exactly when reach(d, i - j) >= i, which is
+// all the backtrace needs to break ties the same way edit_distance does.
+// The frontiers take (d + 1)^2 ints. Past 2^20 of them, once that would be
+// more than the (N + 1)(M + 1) cells of edit_distance or budget.max_bytes,
+// or cannot be allocated, the diff is handed to myers_linear_diff, which
+// may break ties differently.
+inline bool myers_diff(LineSpan src, LineSpan dst, std::vector<Move>& patch,
+                       Scratch& scratch, const Budget& budget) {
+  int n = src.size();
+  int m = dst.size();
+
+  // reach of (d, k) lives at trace[d * d + d + k], -1 when unreachable
+  auto& trace = scratch.trace;
+  trace.clear();
+  auto at = [](int d, int k) { return size_t(d) * (d + 1) + k; };
+  auto reach = [&](int d, int k) {
+    if (d < 0 or k < -d or k > d or k < -m or k > n) return -1;
+    return trace[at(d, k)];
+  };
+  double cells = std::max(double(n + 1) * (m + 1), double(1 << 20));
+
+  int distance = 0;
+  for (int d = 0;; ++d) {
+    if (budget.over(d) or budget.expired()) return false;
+    double size = double(d + 1) * (d + 1);
+    if (size > cells or (budget.max_bytes > 0 and
+                         size * sizeof(int) > budget.max_bytes)) {
+      return myers_linear_diff(src, dst, patch, scratch, budget);
+    }
+    try {
+      trace.resize(size_t(d + 1) * (d + 1), -1);
+    } catch (const std::bad_alloc&) {
+      std::vector<int>().swap(trace);
+      return myers_linear_diff(src, dst, patch, scratch, budget);
+    }
+    scratch.counters.cells += d + 1;
+    bool done = false;
+
+    for (int k = std::max(-d, -m); k <= std::min(d, n); ++k) {
+      if ((k + d) % 2 != 0) continue;
+
+      int x;
+      if (d == 0) {
+        x = 0;
+      } else {
+        int right = reach(d - 1, k - 1);
+        int down = reach(d - 1, k + 1);
+        if (right >= 0) right = std::min(right + 1, n);
+        if (down >= 0) down = std::min(down, m + k);
+        x = std::max({right, down, reach(d - 2, k)});
+      }
+      assert(x >= 0 && "Unreachable diagonal");
+
+      int y = x - k;
+      while (x < n and y < m and src[x] == dst[y]) x++, y++;
+      trace[at(d, k)] = x;
+
+      if (x >= n and y >= m) done = true;
+    }
+
+    if (done) {
+      distance = d;
+      break;
+    }
+  }
+
+  // one move per step of d, filled in from the back
+  size_t start = patch.size();
+  patch.resize(start + distance);
+  int i = n, j = m, d = distance;
+  while (i > 0 or j > 0) {
+    if (i > 0 and j > 0 and src[i - 1] == dst[j - 1]) {
+      i--, j--;
+      continue;
+    }
+
+    bool remove = j == 0 or (i > 0 and reach(d - 1, i - j - 1) >= i - 1);
+    if (remove) {
+      i--;
+      patch[start + d - 1] = Move(REMOVE, src.offset + i);
+    } else {
+      j--;
+      patch[start + d - 1] = Move(ADD, dst.offset + j);
+    }
+    d--;
+  }
+  return true;
+}
+
+struct Snake {
+  int x, y;  // first matching cell
+  int u, v;  // one past the last matching cell
+  int distance;  // of the whole window
+};
+
+// Finds the middle snake of src[a0, a1) and dst[b0, b1) by running the
+// greedy search from both corners until the two frontiers overlap
+// (Myers 1986, section 4b). `forward` and `backward` are scratch arrays of
+// at least 2 * (n + m) + 3 entries, and the frontier entries computed are
+// added to `cells`. Returns false when the search runs out of `budget`:
+// after d rounds the distance is at least d.
+inline bool middle_snake(LineSpan src, LineSpan dst, int a0, int a1, int b0,
+                         int b1, std::vector<int>& forward,
+                         std::vector<int>& backward, const Budget& budget,
+                         uint64_t& cells, Snake& snake) {
+  int n = a1 - a0;
+  int m = b1 - b0;
+  int delta = n - m;
+  bool odd = delta % 2 != 0;
+  int offset = n + m + 1;
+
+  forward[offset + 1] = 0;
+  backward[offset + 1] = 0;
+
+  for (int d = 0; d <= (n + m + 1) / 2; ++d) {
+    if (budget.over(d) or budget.expired()) return false;
+    cells += 2 * (d + 1);
+    for (int k = -d; k <= d; k += 2) {
+      int x;
+      if (k == -d or (k != d and forward[offset + k - 1] <
+                                     forward[offset + k + 1])) {
+        x = forward[offset + k + 1];
+      } else {
+        x = forward[offset + k - 1] + 1;
+      }
+      int y = x - k;
+      int sx = x, sy = y;
+      while (x < n and y < m and src[a0 + x] == dst[b0 + y]) x++, y++;
+      forward[offset + k] = x;
+
+      int c = delta - k;
+      if (odd and c >= -(d - 1) and c <= d - 1 and
+          x + backward[offset + c] >= n) {
+        snake = {a0 + sx, b0 + sy, a0 + x, b0 + y, 2 * d - 1};
+        return true;
+      }
+    }
+
+    for (int c = -d; c <= d; c += 2) {
+      int u;
+      if (c == -d or (c != d and backward[offset + c - 1] <
+                                     backward[offset + c + 1])) {
+        u = backward[offset + c + 1];
+      } else {
+        u = backward[offset + c - 1] + 1;
+      }
+      int v = u - c;
+      int su = u, sv = v;
+      while (u < n and v < m and src[a1 - u - 1] == dst[b1 - v - 1]) u++, v++;
+      backward[offset + c] = u;
+
+      int k = delta - c;
+      if (not odd and k >= -d and k <= d and u + forward[offset + k] >= n) {
+        snake = {a1 - u, b1 - v, a1 - su, b1 - sv, 2 * d};
+        return true;
+      }
+    }
+  }
+
+  assert(false && "Unreachable");
+  return false;
+}
+
+inline bool linear_space_diff(LineSpan src, LineSpan dst, int a0, int a1,
+                              int b0, int b1, std::vector<int>& forward,
+                              std::vector<int>& backward, const Budget& budget,
+                              uint64_t& cells, std::vector<Move>& patch) {
+  while (a0 < a1 and b0 < b1 and src[a0] == dst[b0]) a0++, b0++;
+  while (a0 < a1 and b0 < b1 and src[a1 - 1] == dst[b1 - 1]) a1--, b1--;
+
+  if (a0 == a1) {
+    for (int j = b0; j < b1; ++j) patch.push_back(Move(ADD, dst.offset + j));
+    return true;
+  }
+  if (b0 == b1) {
+    for (int i = a0; i < a1; ++i) patch.push_back(Move(REMOVE, src.offset + i));
+    return true;
+  }
+
+  Snake snake;
+  return middle_snake(src, dst, a0, a1, b0, b1, forward, backward, budget,
+                      cells, snake) and
+         linear_space_diff(src, dst, a0, snake.x, b0, snake.y, forward,
+                           backward, budget, cells, patch) and
+         linear_space_diff(src, dst, snake.u, a1, snake.v, b1, forward,
+                           backward, budget, cells, patch);
+}
+
+// Divide and conquer variant of myers_diff: recursing on middle snakes
+// recovers the edit script in O(N + M) memory instead of keeping the
+// per-d frontiers. The script is minimal, but ties may be broken
+// differently from edit_distance.
+inline bool myers_linear_diff(LineSpan src, LineSpan dst,
+                              std::vector<Move>& patch, Scratch& scratch,
+                              const Budget& budget) {
+  int n = src.size();
+  int m = dst.size();
+
+  scratch.forward.resize(std::max<size_t>(scratch.forward.size(),
+                                          2 * (n + m) + 3));
+  scratch.backward.resize(scratch.forward.size());
+
+  // each middle snake only bounds its own part, the total is checked here
+  size_t start = patch.size();
+  if (not linear_space_diff(src, dst, 0, n, 0, m, scratch.forward,
+                            scratch.backward, budget, scratch.counters.cells,
+                            patch) or
+      budget.over(patch.size() - start)) {
+    patch.resize(start);
+    return false;
+  }
+  return true;
+}
+
+// Groups the positions of every src line by id: those of id c are
+// positions[first[c], first[c + 1]). Returns the number of ids in use.
+inline uint32_t group_positions(LineSpan src, Scratch& scratch) {
+  int n = src.size();
+  uint32_t alphabet = 0;
+  for (int i = 0; i < n; ++i) alphabet = std::max(alphabet, src[i] + 1);
+  auto& first = scratch.first;
+  first.assign(alphabet + 1, 0);
+  for (int i = 0; i < n; ++i) first[src[i] + 1]++;
+  for (uint32_t c = 0; c < alphabet; ++c) first[c + 1] += first[c];
+  auto& positions = scratch.positions;
+  positions.resize(n);
+  auto& fill = scratch.fill;
+  fill.assign(first.begin(), first.end() - 1);
+  for (int i = 0; i < n; ++i) positions[fill[src[i]]++] = i;
+  return alphabet;
+}
+
+// One column of the bit-parallel LCS: `column` from `previous` and the bits
+// of the src lines equal to the dst line. The two may be the same array.
+inline void advance_column(const uint64_t* previous, uint64_t* column,
+                           const uint64_t* match, int words) {
+  uint64_t carry = 0;
+  for (int w = 0; w < words; ++w) {
+    uint64_t v = previous[w];
+    uint64_t u = v & match[w];
+    uint64_t sum = v + u;
+    uint64_t overflow = sum < v;
+    sum += carry;
+    carry = overflow | (sum < carry);
+    column[w] = sum | (v & ~match[w]);
+  }
+}
+
+// The LCS of n src lines is the number of clear bits in a column.
+inline int count_common(const uint64_t* column, int n) {
+  int words = (n + 63) / 64;
+  int lcs = 0;
+  for (int w = 0; w < words; ++w) {
+    uint64_t clear = ~column[w];
+    if (w == words - 1 and n % 64 != 0) clear &= (uint64_t(1) << n % 64) - 1;
+    lcs += __builtin_popcountll(clear);
+  }
+  return lcs;
+}
+
+// The only script there is when a side is empty: every line of the other
+// removed or added.
+inline bool one_sided_diff(LineSpan src, LineSpan dst,
+                           std::vector<Move>& patch, const Budget& budget) {
+  int n = src.size();
+  int m = dst.size();
+  if (budget.over(n + m)) return false;
+  for (int i = 0; i < n; ++i) patch.push_back(Move(REMOVE, src.offset + i));
+  for (int j = 0; j < m; ++j) patch.push_back(Move(ADD, dst.offset + j));
+  return true;
+}
+
+// Bit-parallel LCS (Allison-Dix, Hyyro): one bit per src line, so a column
+// of the DP is computed 64 cells per word. Bit i of column j is clear when
+// L(i + 1, j) = L(i, j) + 1. Keeping every column costs (n / 64) words per
+// dst line, and the backtrace can still read the DP's tie breaks off it:
+// a mismatch at (i, j) is a REMOVE exactly when L(i - 1, j) = L(i, j).
+inline bool bit_parallel_diff(LineSpan src, LineSpan dst,
+                              std::vector<Move>& patch, Scratch& scratch,
+                              const Budget& budget) {
+  int n = src.size();
+  int m = dst.size();
+  // without src lines there would be no column words to point into
+  if (n == 0 or m == 0) return one_sided_diff(src, dst, patch, budget);
+  int words = (n + 63) / 64;
+  if (budget.over(std::abs(n - m))) return false;
+
+  uint32_t alphabet = group_positions(src, scratch);
+  const auto& first = scratch.first;
+  const auto& positions = scratch.positions;
+  auto& columns = scratch.columns;
+  columns.assign((size_t)(m + 1) * words, ~uint64_t(0));
+  auto& match = scratch.match;
+  match.assign(words, 0);
+
+  for (int j = 0; j < m; ++j) {
+    if (j % 256 == 0 and budget.expired()) return false;
+    uint32_t c = dst[j];
+    int begin = c < alphabet ? first[c] : 0;
+    int end = c < alphabet ? first[c + 1] : 0;
+    for (int p = begin; p < end; ++p) {
+      match[positions[p] / 64] |= uint64_t(1) << (positions[p] % 64);
+    }
+
+    advance_column(&columns[(size_t)j * words],
+                   &columns[(size_t)(j + 1) * words], match.data(), words);
+    scratch.counters.cells += n;
+
+    for (int p = begin; p < end; ++p) match[positions[p] / 64] = 0;
+  }
+
+  // The LCS gives the number of moves, so they can be filled in from the
+  // back.
+  int lcs = count_common(&columns[(size_t)m * words], n);
+  if (budget.over(n + m - 2 * lcs)) return false;
+  size_t next = patch.size() + n + m - 2 * lcs;
+  patch.resize(next);
+
+  int i = n, j = m;
+  while (i > 0 or j > 0) {
+    if (i > 0 and j > 0 and src[i - 1] == dst[j - 1]) {
+      i--, j--;
+      continue;
+    }
+
+    const uint64_t* column = &columns[(size_t)j * words];
+    bool remove =
+        j == 0 or (i > 0 and (column[(i - 1) / 64] >> ((i - 1) % 64)) & 1);
+    if (remove) {
+      i--;
+      patch[--next] = Move(REMOVE, src.offset + i);
+    } else {
+      j--;
+      patch[--next] = Move(ADD, dst.offset + j);
+    }
+  }
+  assert(next + n + m - 2 * lcs == patch.size() && "Miscounted moves");
+  return true;
+}
+
+// The length of the longest common subsequence, by the same recurrence as
+// bit_parallel_diff but keeping only the current column, with a bit per
+// line of the shorter side: O(min(n, m) / 64) words besides the line
+// positions. False when a shortest script would be over `budget`.
+inline bool lcs_length(LineSpan src, LineSpan dst, Scratch& scratch,
+                       const Budget& budget, int& lcs) {
+  if (src.size() > dst.size()) std::swap(src, dst);
+  int n = src.size();
+  int m = dst.size();
+  int words = (n + 63) / 64;
+  if (budget.over(m - n)) return false;
+
+  uint32_t alphabet = group_positions(src, scratch);
+  const auto& first = scratch.first;
+  const auto& positions = scratch.positions;
+  auto& column = scratch.columns;
+  column.assign(words, ~uint64_t(0));
+  auto& match = scratch.match;
+  match.assign(words, 0);
+
+  for (int j = 0; j < m; ++j) {
+    if (j % 256 == 0 and budget.expired()) return false;
+    uint32_t c = dst[j];
+    int begin = c < alphabet ? first[c] : 0;
+    int end = c < alphabet ? first[c + 1] : 0;
+    for (int p = begin; p < end; ++p) {
+      match[positions[p] / 64] |= uint64_t(1) << (positions[p] % 64);
+    }
+    advance_column(column.data(), column.data(), match.data(), words);
+    scratch.counters.cells += n;
+    for (int p = begin; p < end; ++p) match[positions[p] / 64] = 0;
+  }
+
+  lcs = count_common(column.data(), n);
+  return not budget.over(n + m - 2 * lcs);
+}
+
+// The length of a shortest edit script. Searching from both ends for the
+// middle snake costs about d^2 + n + m, the bit-parallel LCS n m / 64
+// whatever d is, so the search only runs until d gets past where the LCS
+// would have been cheaper. Both keep O(n + m) memory.
+inline bool shortest_distance(LineSpan src, LineSpan dst, Scratch& scratch,
+                              const Budget& budget, int& distance) {
+  int n = src.size();
+  int m = dst.size();
+  if (n == 0 or m == 0) {
+    distance = n + m;
+    return not budget.over(distance);
+  }
+
+  int cheaper = std::sqrt(double(n) * m) / 8 + 1;
+  Budget rounds = budget;
+  if (budget.max_distance < 0 or budget.max_distance > cheaper) {
+    rounds.max_distance = cheaper;
+  }
+  scratch.forward.resize(std::max<size_t>(scratch.forward.size(),
+                                          2 * (n + m) + 3));
+  scratch.backward.resize(scratch.forward.size());
+  Snake snake;
+  if (middle_snake(src, dst, 0, n, 0, m, scratch.forward, scratch.backward,
+                   rounds, scratch.counters.cells, snake)) {
+    distance = snake.distance;
+    return not budget.over(distance);
+  }
+  if (rounds.max_distance != cheaper or budget.expired()) return false;
+
+  int lcs;
+  if (not lcs_length(src, dst, scratch, budget, lcs)) return false;
+  distance = n + m - 2 * lcs;
+  return true;
+}
+
+// A rough count of the lines only one side has: up to 256 evenly spaced
+// lines of each side are looked up in a bitmap of the hashed ids of the
+// other. Collisions only make the count smaller. `repeated` is set to the
+// share of src lines whose bit was already set: lines that repeat a lot
+// leave the count saying little about the distance.
+inline long estimate_distance(LineSpan src, LineSpan dst, Scratch& scratch,
+                              double& repeated) {
+  int n = src.size();
+  int m = dst.size();
+  // bitmaps of 2^log bits, about 4 per line
+  int log = 10;
+  while (log < 22 and (uint64_t(1) << log) < 4 * uint64_t(n + m)) log++;
+  int shift = 32 - log;
+  size_t words = (uint64_t(1) << log) / 64;
+  auto& seen = scratch.seen;
+  seen.assign(2 * words, 0);
+  uint64_t* in_src = seen.data();
+  uint64_t* in_dst = seen.data() + words;
+  auto bit = [&](uint32_t id) { return uint32_t(id * 0x9e3779b1u) >> shift; };
+  auto has = [](const uint64_t* bitmap, uint32_t b) {
+    return (bitmap[b / 64] >> (b % 64)) & 1;
+  };
+
+  int collisions = 0;
+  for (int i = 0; i < n; ++i) {
+    uint32_t b = bit(src[i]);
+    collisions += has(in_src, b);
+    in_src[b / 64] |= uint64_t(1) << (b % 64);
+  }
+  for (int j = 0; j < m; ++j) {
+    uint32_t b = bit(dst[j]);
+    in_dst[b / 64] |= uint64_t(1) << (b % 64);
+  }
+  repeated = n > 0 ? double(collisions) / n : 0;
+
+  auto missing = [&](LineSpan lines, const uint64_t* other) {
+    int samples = std::min(lines.size(), 256);
+    long misses = 0;
+    for (int k = 0; k < samples; ++k) {
+      misses += not has(other, bit(lines[long(k) * lines.size() / samples]));
+    }
+    return samples > 0 ? misses * lines.size() / samples : 0;
+  };
+  return missing(src, in_dst) + missing(dst, in_src);
+}
+
+// The engine for --algorithm=auto, picked for each region from what costs
+// next to nothing to observe: its size, a sampled estimate of its distance
+// and budget.max_bytes. Small regions get edit_distance. Larger ones try
+// myers_diff with the distance bounded where the bit-parallel LCS gets
+// cheaper (as in shortest_distance) or its frontiers would no longer fit,
+// and switch to bit_parallel_diff once it goes past that, or right away
+// when the estimate says it would. All three break ties alike, so only a
+// region whose bit-parallel columns would not fit either, which goes to
+// myers_linear_diff, may come out differently. The choices are counted in
+// scratch.counters.
+inline bool auto_diff(LineSpan src, LineSpan dst, std::vector<Move>& patch,
+                      Scratch& scratch, const Budget& budget) {
+  int n = src.size();
+  int m = dst.size();
+  // nothing to choose, and the heuristics below would judge it hopeless
+  if (n == 0 or m == 0) return one_sided_diff(src, dst, patch, budget);
+  auto& counters = scratch.counters;
+  auto fits = [&](double bytes) {
+    return budget.max_bytes == 0 or bytes <= budget.max_bytes;
+  };
+
+  double cells = double(n + 1) * (m + 1);
+  if (cells <= 4096 and fits(cells * (sizeof(int) + 1))) {
+    counters.dp++;
+    return edit_distance(src, dst, patch, scratch, budget);
+  }
+
+  long limit = std::sqrt(double(n) * m) / 8 + 1;
+  if (budget.max_bytes > 0) {
+    // myers_diff keeps (d + 1)^2 reaches
+    long fit = std::sqrt(budget.max_bytes / sizeof(int)) - 1;
+    limit = std::clamp<long>(fit, 0, limit);
+  }
+  double repeated;
+  long estimate = estimate_distance(src, dst, scratch, repeated);
+  estimate = std::max<long>(estimate, std::abs(n - m));
+  bool hopeless =
+      std::abs(n - m) > limit or (repeated < 0.5 and estimate > 2 * limit);
+  if (not hopeless) {
+    Budget bounded = budget;
+    if (budget.max_distance < 0 or budget.max_distance > limit) {
+      bounded.max_distance = limit;
+    }
+    if (myers_diff(src, dst, patch, scratch, bounded)) {
+      counters.myers++;
+      return true;
+    }
+    // beyond what the caller allows, not just past the bound set here
+    if (bounded.max_distance != limit or budget.expired()) return false;
+    counters.switched++;
+  }
+
+  int words = (n + 63) / 64;
+  if (fits(double(m + 1) * words * sizeof(uint64_t))) {
+    counters.bit_parallel++;
+    return bit_parallel_diff(src, dst, patch, scratch, budget);
+  }
+  counters.linear_space++;
+  return myers_linear_diff(src, dst, patch, scratch, budget);
+}
+
+// Drops the common head and tail of both windows, which every engine would
+// otherwise have to walk through.
+inline void trim_common(LineSpan& src, LineSpan& dst) {
+  int n = src.size();
+  int m = dst.size();
+
+  int head = 0;
+  while (head < n and head < m and src[head] == dst[head]) head++;
+
+  int tail = 0;
+  while (tail < n - head and tail < m - head and
+         src[n - 1 - tail] == dst[m - 1 - tail]) {
+    tail++;
+  }
+
+  src = src.sub(head, n - tail);
+  dst = dst.sub(head, m - tail);
+}
+
+// A pair of windows that can be diffed independently of everything else.
+struct Region {
+  LineSpan src;
+  LineSpan dst;
+};
+
+// Patience diff: lines that occur exactly once in both windows are paired
+// up, the longest run of pairs that is increasing on both sides becomes the
+// set of anchors, and only the gaps between anchors are recursed into. Gaps
+// without unique lines are appended to `regions`, in order, for an engine to
+// diff. `scratch.slots` is indexed by line id and is left zeroed on return.
+inline void patience_regions(LineSpan src, LineSpan dst, Scratch& scratch,
+                             std::vector<Region>& regions) {
+  trim_common(src, dst);
+  int n = src.size();
+  int m = dst.size();
+  if (n == 0 and m == 0) return;
+  if (n == 0 or m == 0) {
+    regions.push_back({src, dst});
+    return;
+  }
+
+  auto& slots = scratch.slots;
+  for (int i = 0; i < n; ++i) {
+    auto& slot = slots[src[i]];
+    slot.src_count++;
+    slot.src_index = i;
+  }
+  for (int j = 0; j < m; ++j) slots[dst[j]].dst_count++;
+
+  // (src index, dst index) of every unique pair, in dst order
+  auto& pairs = scratch.pairs;
+  pairs.clear();
+  for (int j = 0; j < m; ++j) {
+    const auto& slot = slots[dst[j]];
+    if (slot.src_count == 1 and slot.dst_count == 1) {
+      pairs.push_back({slot.src_index, j});
+    }
+  }
+
+  for (int i = 0; i < n; ++i) slots[src[i]] = PatienceSlot();
+  for (int j = 0; j < m; ++j) slots[dst[j]] = PatienceSlot();
+
+  // longest increasing subsequence of the src indices by patience sorting
+  auto& piles = scratch.piles;
+  auto& previous = scratch.previous;
+  piles.clear();
+  previous.assign(pairs.size(), -1);
+  for (int p = 0; p < (int)pairs.size(); ++p) {
+    auto pile = std::lower_bound(
+        piles.begin(), piles.end(), pairs[p].first,
+        [&](int top, int value) { return pairs[top].first < value; });
+    if (pile != piles.begin()) previous[p] = *(pile - 1);
+    if (pile == piles.end()) {
+      piles.push_back(p);
+    } else {
+      *pile = p;
+    }
+  }
+
+  if (piles.empty()) {
+    regions.push_back({src, dst});
+    return;
+  }
+
+  // The anchors of every level of the recursion share one stack, this
+  // level's are [base, end) and the levels below push and pop above them.
+  auto& anchors = scratch.anchors;
+  size_t base = anchors.size();
+  for (int p = piles.back(); p != -1; p = previous[p]) {
+    anchors.push_back(pairs[p]);
+  }
+  std::reverse(anchors.begin() + base, anchors.end());
+  size_t end = anchors.size();
+
+  int i = 0, j = 0;
+  for (size_t t = base; t < end; ++t) {
+    auto [a, b] = anchors[t];
+    patience_regions(src.sub(i, a), dst.sub(j, b), scratch, regions);
+    i = a + 1, j = b + 1;
+  }
+  patience_regions(src.sub(i, n), dst.sub(j, m), scratch, regions);
+  anchors.resize(base);
+}
+
+// A fixed set of workers with one task deque each. A worker takes the newest
+// task of its own deque and, once that runs dry, steals the oldest task of
+// another worker.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int threads) {
+    for (int t = 0; t < threads; ++t) {
+      queues.push_back(std::make_unique<Queue>());
+    }
+    // a thread that cannot start throws std::system_error, and the ones
+    // already running must be joined before it leaves
+    try {
+      for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([this, t] { work(t); });
+      }
+    } catch (...) {
+      stop();
+      throw;
+    }
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool() { stop(); }
+
+  void submit(std::function<void()> task) {
+    auto& queue = *queues[next.fetch_add(1) % queues.size()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queued++;
+      unfinished++;
+    }
+    wake.notify_one();
+  }
+
+  // Blocks until every submitted task has finished.
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return unfinished == 0; });
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) worker.join();
+  }
+
+  bool take(int t, std::function<void()>& task) {
+    for (size_t k = 0; k < queues.size(); ++k) {
+      auto& queue = *queues[(t + k) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty()) continue;
+      if (k == 0) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void work(int t) {
+    while (true) {
+      std::function<void()> task;
+      if (take(t, task)) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          queued--;
+        }
+        task();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--unfinished == 0) idle.notify_all();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this] { return stopping or queued > 0; });
+      if (stopping and queued == 0) return;
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> next{0};  // submit() may be called from any thread
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  size_t queued = 0;
+  size_t unfinished = 0;
+  bool stopping = false;
+};
+
+struct DiffOptions {
+  Engine engine = myers_diff;
+  bool patience = false;
+  int jobs = 1;  // threads the independent regions are spread over
+  Budget budget;
+  // Regions that go over budget are handed to approximate_diff instead of
+  // failing the whole diff.
+  bool approximate = false;
+};
+
+// The fallback for a region whose diff went over budget: it is anchored on
+// its unique lines as by --patience, but every gap between anchors is
+// replaced wholesale instead of diffed. This takes O(n log n) time and is
+// always a valid patch, though possibly a much longer one.
+inline void approximate_diff(LineSpan src, LineSpan dst, Scratch& scratch,
+                             std::vector<Move>& patch) {
+  std::vector<Region> gaps;
+  patience_regions(src, dst, scratch, gaps);
+  for (auto [a, b] : gaps) {
+    for (int i = 0; i < a.size(); ++i) {
+      patch.push_back(Move(REMOVE, a.offset + i));
+    }
+    for (int j = 0; j < b.size(); ++j) patch.push_back(Move(ADD, b.offset + j));
+  }
+}
+
+// The regions of `src` and `dst` that are left to diff, after patience
+// anchoring or just trimming their common head and tail.
+inline void split_regions(LineSpan src, LineSpan dst, uint32_t count,
+                          const DiffOptions& options, Scratch& scratch,
+                          std::vector<Region>& regions) {
+  if ((options.patience or options.approximate) and
+      scratch.slots.size() < count) {
+    scratch.slots.resize(count);
+  }
+  regions.clear();
+  if (options.patience) {
+    patience_regions(src, dst, scratch, regions);
+  } else {
+    trim_common(src, dst);
+    if (src.size() > 0 or dst.size() > 0) regions.push_back({src, dst});
+  }
+}
+
+// Appends the edit script of `regions`, in order, to `patch`. Returns false
+// if some region went over `options.budget`; without `options.approximate`
+// the patch is then incomplete. Throws std::bad_alloc (also for allocations
+// that fail on a worker) and std::system_error when no thread can be
+// started.
+inline bool diff_regions(const std::vector<Region>& regions,
+                         const DiffOptions& options, Scratch& scratch,
+                         std::vector<Move>& patch) {
+  const Budget& budget = options.budget;
+  bool within = true;
+  if (options.jobs <= 1 or regions.size() <= 1) {
+    // every region gets what the ones before it left of the distance
+    size_t start = patch.size();
+    Budget left = budget;
+    for (auto [src, dst] : regions) {
+      if (budget.max_distance >= 0) {
+        left.max_distance =
+            std::max<long>(0, budget.max_distance - (patch.size() - start));
+      }
+      if (options.engine(src, dst, patch, scratch, left)) continue;
+      within = false;
+      if (not options.approximate) return false;
+      approximate_diff(src, dst, scratch, patch);
+    }
+    return within;
+  }
+
+  // Every region gets its own patch, stitched back together in order below.
+  // They run at the same time, so each may use the whole distance.
+  std::vector<std::vector<Move>> patches(regions.size());
+  std::vector<char> done(regions.size());
+  std::atomic<bool> out_of_memory = false;
+  std::mutex counters_mutex;
+  {
+    ThreadPool pool(std::min<size_t>(options.jobs, regions.size()));
+    for (size_t r = 0; r < regions.size(); ++r) {
+      pool.submit([&, r] {
+        thread_local Scratch worker_scratch;
+        worker_scratch.counters = EngineCounters();
+        try {
+          done[r] = options.engine(regions[r].src, regions[r].dst, patches[r],
+                                   worker_scratch, budget);
+        } catch (const std::bad_alloc&) {
+          out_of_memory = true;
+        }
+        std::lock_guard<std::mutex> lock(counters_mutex);
+        scratch.counters += worker_scratch.counters;
+      });
+    }
+    pool.wait();
+  }
+  if (out_of_memory) throw std::bad_alloc();
+
+  size_t size = patch.size();
+  for (size_t r = 0; r < regions.size(); ++r) {
+    if (done[r]) continue;
+    within = false;
+    if (not options.approximate) return false;
+    approximate_diff(regions[r].src, regions[r].dst, scratch, patches[r]);
+  }
+  for (const auto& part : patches) size += part.size();
+  if (budget.over(size - patch.size())) within = false;
+  if (not within and not options.approximate) return false;
+
+  patch.reserve(size);
+  for (const auto& part : patches) {
+    patch.insert(patch.end(), part.begin(), part.end());
+  }
+  return within;
+}
+
+// Appends the edit script of the `count` distinct line ids in `src` and
+// `dst` to `patch`, as diff_regions does for split_regions' regions.
+inline bool diff_spans(LineSpan src, LineSpan dst, uint32_t count,
+                       const DiffOptions& options, Scratch& scratch,
+                       std::vector<Region>& regions, std::vector<Move>& patch) {
+  split_regions(src, dst, count, options, scratch, regions);
+  return diff_regions(regions, options, scratch, patch);
+}
+
+struct DiffStat {
+  long insertions = 0;  // ADD moves
+  long deletions = 0;   // REMOVE moves
+};
+
+// Counts the moves of the patch diff_spans would find, without finding it:
+// every engine gives a shortest script of each region, and its length is
+// all the counts depend on. Runs on one thread in O(n + m) memory. False
+// when the count is over `options.budget`.
+inline bool count_spans(LineSpan src, LineSpan dst, uint32_t count,
+                        const DiffOptions& options, Scratch& scratch,
+                        std::vector<Region>& regions, DiffStat& stat) {
+  split_regions(src, dst, count, options, scratch, regions);
+  const Budget& budget = options.budget;
+  Budget left = budget;
+  stat = DiffStat();
+  for (auto [src, dst] : regions) {
+    if (budget.max_distance >= 0) {
+      long used = stat.insertions + stat.deletions;
+      left.max_distance = std::max<long>(0, budget.max_distance - used);
+    }
+    int distance;
+    if (not shortest_distance(src, dst, scratch, left, distance)) {
+      return false;
+    }
+    // every line that is not common is either added or removed
+    stat.insertions += (distance + dst.size() - src.size()) / 2;
+    stat.deletions += (distance + src.size() - dst.size()) / 2;
+  }
+  return true;
+}
+
+struct InternedLines {
+  std::vector<uint32_t> src;
+  std::vector<uint32_t> dst;
+  uint32_t count;  // number of distinct lines, ids are in [0, count)
+};
+
+// The whole patch at once. `within`, when given, tells whether the diff
+// stayed within options.budget.
+inline std::vector<Move> diff_lines(const InternedLines& lines,
+                                    const DiffOptions& options,
+                                    bool* within = nullptr) {
+  Scratch scratch;
+  std::vector<Region> regions;
+  std::vector<Move> patch;
+  bool ok = diff_spans(lines.src, lines.dst, lines.count, options, scratch,
+                       regions, patch);
+  if (within) *within = ok;
+  return patch;
+}
+
+// A run of added lines that repeats source lines: dst lines [m, m + count)
+// are src lines [n, n + count). A MOVE also stands for removing those
+// source lines, a COPY leaves them be.
+const char MOVE = '>';
+const char COPY = '*';
+
+struct Block {
+  char action;
+  int n, m, count;
+};
+
+// Blocks shorter than this are left as separate records.
+const int MIN_BLOCK = 3;
+
+// Finds the blocks among the ADDs of `patch`: every MIN_BLOCK lines long
+// window of the source is indexed by a rolling hash of its ids, and the
+// windows of each run of added lines are looked up in it and grown as far as
+// they match. A window whose lines were all removed, and not moved yet, is
+// preferred and makes a MOVE. This is about linear in the size of the
+// files.
+inline void find_blocks(const InternedLines& lines,
+                        const std::vector<Move>& patch,
+                        std::vector<Block>& blocks) {
+  const auto& src = lines.src;
+  const auto& dst = lines.dst;
+  int n = src.size();
+  int m = dst.size();
+  blocks.clear();
+  if (n < MIN_BLOCK) return;
+
+  std::vector<char> added(m), moved(n);
+  std::vector<int> removed_before(n + 1);  // removed lines before i
+  for (const auto& move : patch) {
+    if (move.action == ADD) added[move.n] = true;
+    if (move.action == REMOVE) removed_before[move.n + 1] = 1;
+  }
+  for (int i = 0; i < n; ++i) removed_before[i + 1] += removed_before[i];
+  auto movable = [&](int i, int count) {
+    if (removed_before[i + count] - removed_before[i] != count) return false;
+    for (int k = i; k < i + count; ++k) {
+      if (moved[k]) return false;
+    }
+    return true;
+  };
+
+  // h(window) = sum of (id + 1) * BASE^(MIN_BLOCK - 1 - k), mod 2^64
+  const uint64_t BASE = 0x100000001b3;
+  uint64_t top = 1;  // BASE^(MIN_BLOCK - 1)
+  for (int k = 1; k < MIN_BLOCK; ++k) top *= BASE;
+  auto hash = [&](const std::vector<uint32_t>& ids, int begin) {
+    uint64_t h = 0;
+    for (int k = begin; k < begin + MIN_BLOCK; ++k) h = h * BASE + ids[k] + 1;
+    return h;
+  };
+  auto roll = [&](uint64_t h, uint32_t out, uint32_t in) {
+    return (h - (out + 1) * top) * BASE + in + 1;
+  };
+
+  // open addressing from window hash to its first start, -1 when empty
+  size_t size = 1;
+  while (size < 2 * size_t(n)) size <<= 1;
+  std::vector<std::pair<uint64_t, int>> table(size, {0, -1});
+  auto slot = [&](uint64_t h) -> std::pair<uint64_t, int>& {
+    size_t k = (h ^ h >> 29) & (size - 1);
+    while (table[k].second >= 0 and table[k].first != h) {
+      k = (k + 1) & (size - 1);
+    }
+    return table[k];
+  };
+  uint64_t h = hash(src, 0);
+  for (int i = 0;; ++i) {
+    auto& entry = slot(h);
+    if (entry.second < 0 or
+        (not movable(entry.second, MIN_BLOCK) and movable(i, MIN_BLOCK))) {
+      entry = {h, i};
+    }
+    if (i + MIN_BLOCK == n) break;
+    h = roll(h, src[i], src[i + MIN_BLOCK]);
+  }
+
+  for (int j = 0; j < m;) {
+    if (not added[j]) {
+      j++;
+      continue;
+    }
+    int end = j;  // of the run of added lines
+    while (end < m and added[end]) end++;
+    bool fresh = true;
+    for (; j + MIN_BLOCK <= end; ++j) {
+      if (fresh) h = hash(dst, j);
+      fresh = false;
+      int i = slot(h).second;
+      if (i < 0 or not std::equal(&dst[j], &dst[j] + MIN_BLOCK, &src[i])) {
+        if (j + MIN_BLOCK < end) h = roll(h, dst[j], dst[j + MIN_BLOCK]);
+        continue;
+      }
+
+      bool move = movable(i, MIN_BLOCK);
+      int count = MIN_BLOCK;
+      while (j + count < end and i + count < n and
+             src[i + count] == dst[j + count] and
+             (not move or movable(i + count, 1))) {
+        count++;
+      }
+      if (move) std::fill(&moved[i], &moved[i] + count, true);
+      blocks.push_back({move ? MOVE : COPY, i, j, count});
+      j += count - 1;
+      fresh = true;
+    }
+    j = end;
+  }
+}
+
+// One change of a side of a three-way merge: base lines
+// [base_begin, base_end) became lines [begin, end) of that side.
+struct Hunk {
+  int base_begin, base_end;
+  int begin, end;
+};
+
+// The hunks of a patch from the base to one side, in order. Moves between
+// which no common line is skipped belong to the same hunk.
+inline void collect_hunks(const std::vector<Move>& patch,
+                          std::vector<Hunk>& hunks) {
+  hunks.clear();
+  int i = 0, j = 0;  // base and side lines passed
+  bool open = false;
+  for (const auto& move : patch) {
+    int common = move.action == REMOVE ? move.n - i : move.n - j;
+    if (common > 0) {
+      if (open) hunks.back().base_end = i, hunks.back().end = j;
+      open = false;
+      i += common, j += common;
+    }
+    if (not open) hunks.push_back({i, i, j, j});
+    open = true;
+    (move.action == REMOVE ? i : j)++;
+  }
+  if (open) hunks.back().base_end = i, hunks.back().end = j;
+}
+
+// Moves every hunk that only removes or only adds lines as far down as the
+// lines after it allow, as git does: which run of equal lines the engine
+// picked is a tie-break, and two sides that broke it apart would otherwise
+// conflict over nothing. A hunk that comes to touch the next one joins it.
+inline void slide_hunks(LineSpan base, LineSpan side,
+                        std::vector<Hunk>& hunks) {
+  size_t kept = 0;
+  for (size_t h = 0; h < hunks.size(); ++h) {
+    Hunk hunk = hunks[h];
+    int base_limit = h + 1 < hunks.size() ? hunks[h + 1].base_begin
+                                          : int(base.size());
+    int side_limit = h + 1 < hunks.size() ? hunks[h + 1].begin
+                                          : int(side.size());
+    if (hunk.begin == hunk.end) {
+      while (hunk.base_end < base_limit and
+             base[hunk.base_begin] == base[hunk.base_end]) {
+        hunk.base_begin++, hunk.base_end++, hunk.begin++, hunk.end++;
+      }
+    } else if (hunk.base_begin == hunk.base_end) {
+      while (hunk.end < side_limit and side[hunk.begin] == side[hunk.end]) {
+        hunk.base_begin++, hunk.base_end++, hunk.begin++, hunk.end++;
+      }
+    }
+    if (h + 1 < hunks.size() and hunk.base_end == base_limit and
+        hunk.end == side_limit) {
+      hunks[h + 1].base_begin = hunk.base_begin;
+      hunks[h + 1].begin = hunk.begin;
+      continue;
+    }
+    hunks[kept++] = hunk;
+  }
+  hunks.resize(kept);
+}
+
+// What goes into a stretch of the merged file: the base lines as they are,
+// the lines of the one side that changed them, those of both sides when
+// they changed them alike, or a conflict.
+const char KEEP = '=';
+const char OURS = '<';
+const char THEIRS = '>';
+const char BOTH = '&';
+const char CONFLICT = '!';
+
+struct MergeRegion {
+  char kind;
+  int base_begin, base_end;
+  int ours_begin, ours_end;
+  int theirs_begin, theirs_end;
+};
+
+// Merges the patches from `base` to `ours` and to `theirs` in one pass over
+// their hunks, appending the regions of the result to `regions` in order.
+// Hunks of the two sides that overlap or touch are one region, as in git:
+// a conflict unless both sides made it the same lines. Returns the number
+// of conflicts. Hunks are slid first (see slide_hunks), but where lines
+// repeat a lot the engines can still align a side differently from git's
+// diff, and then one of the two may report a conflict the other does not.
+inline int merge3(LineSpan base, LineSpan ours, LineSpan theirs,
+                  const std::vector<Move>& to_ours,
+                  const std::vector<Move>& to_theirs,
+                  std::vector<MergeRegion>& regions) {
+  std::vector<Hunk> mine, others;
+  collect_hunks(to_ours, mine);
+  collect_hunks(to_theirs, others);
+  slide_hunks(base, ours, mine);
+  slide_hunks(base, theirs, others);
+
+  // a side's line minus the base line it matches, outside of its hunks
+  int ours_delta = 0, theirs_delta = 0;
+  int position = 0;  // base lines merged
+  int conflicts = 0;
+  size_t a = 0, b = 0;
+  auto keep = [&](int end) {
+    if (end <= position) return;
+    regions.push_back({KEEP, position, end, position + ours_delta,
+                       end + ours_delta, position + theirs_delta,
+                       end + theirs_delta});
+  };
+  while (a < mine.size() or b < others.size()) {
+    int start = std::min(
+        a < mine.size() ? mine[a].base_begin : base.size(),
+        b < others.size() ? others[b].base_begin : base.size());
+    keep(start);
+
+    int end = start;
+    size_t a1 = a, b1 = b;
+    for (bool grew = true; grew;) {
+      grew = false;
+      for (; a1 < mine.size() and mine[a1].base_begin <= end; ++a1) {
+        end = std::max(end, mine[a1].base_end);
+        grew = true;
+      }
+      for (; b1 < others.size() and others[b1].base_begin <= end; ++b1) {
+        end = std::max(end, others[b1].base_end);
+        grew = true;
+      }
+    }
+
+    MergeRegion region = {KEEP, start, end, start + ours_delta, 0,
+                          start + theirs_delta, 0};
+    if (a1 > a) ours_delta = mine[a1 - 1].end - mine[a1 - 1].base_end;
+    if (b1 > b) theirs_delta = others[b1 - 1].end - others[b1 - 1].base_end;
+    region.ours_end = end + ours_delta;
+    region.theirs_end = end + theirs_delta;
+
+    if (b1 == b) {
+      region.kind = OURS;
+    } else if (a1 == a) {
+      region.kind = THEIRS;
+    } else {
+      int size = region.ours_end - region.ours_begin;
+      bool same = size == region.theirs_end - region.theirs_begin;
+      for (int k = 0; same and k < size; ++k) {
+        same = ours[region.ours_begin + k] == theirs[region.theirs_begin + k];
+      }
+      region.kind = same ? BOTH : CONFLICT;
+      conflicts += not same;
+    }
+    regions.push_back(region);
+    position = end;
+    a = a1, b = b1;
+  }
+  keep(base.size());
+  return conflicts;
+}
+
+// Gives every distinct line a dense id. The table is open addressing over
+// views of the lines, and clear() only starts a new generation, so reusing
+// an interner frees and allocates nothing once it is large enough.
+class LineInterner {
+ public:
+  uint32_t intern(std::string_view line) {
+    if (2 * (lines.size() + 1) > table.size()) grow();
+    size_t hash = std::hash<std::string_view>()(line);
+    size_t mask = table.size() - 1;
+    for (size_t k = hash & mask;; k = (k + 1) & mask) {
+      auto& slot = table[k];
+      if (slot.generation != generation) {
+        slot = {generation, uint32_t(lines.size()), hash};
+        lines.push_back(line);
+        return slot.id;
+      }
+      if (slot.hash == hash and lines[slot.id] == line) return slot.id;
+    }
+  }
+
+  uint32_t count() const { return lines.size(); }
+
+  void clear() {
+    lines.clear();
+    if (++generation == 0) {
+      // wrapped around, so old slots could look current
+      for (auto& slot : table) slot.generation = 0;
+      generation = 1;
+    }
+  }
+
+ private:
+  struct Slot {
+    uint32_t generation = 0;  // the slot is empty unless this is current
+    uint32_t id;
+    size_t hash;
+  };
+
+  void grow() {
+    std::vector<Slot> old(std::max<size_t>(64, 2 * table.size()));
+    std::swap(old, table);
+    size_t mask = table.size() - 1;
+    for (const auto& slot : old) {
+      if (slot.generation != generation) continue;
+      size_t k = slot.hash & mask;
+      while (table[k].generation == generation) k = (k + 1) & mask;
+      table[k] = slot;
+    }
+  }
+
+  std::vector<Slot> table;
+  std::vector<std::string_view> lines;  // by id
+  uint32_t generation = 1;
+};
+
+enum class Status {
+  OK = 0,
+  INVALID_ARGUMENT,  // e.g. a line id that is not below the given count
+  TOO_LARGE,         // more lines than a Move can number
+  OUT_OF_MEMORY,
+  SYSTEM_ERROR,     // no worker thread could be started
+  BUDGET_EXCEEDED,  // over options.budget; nothing went to the sink
+  APPROXIMATE,      // over options.budget, but options.approximate gave a
+                    // valid, possibly longer, patch that went to the sink
+};
+
+inline const char* status_message(Status status) {
+  switch (status) {
+    case Status::OK:
+      return "ok";
+    case Status::INVALID_ARGUMENT:
+      return "invalid argument";
+    case Status::TOO_LARGE:
+      return "too many lines";
+    case Status::OUT_OF_MEMORY:
+      return "out of memory";
+    case Status::SYSTEM_ERROR:
+      return "cannot start worker threads";
+    case Status::BUDGET_EXCEEDED:
+      return "over the distance or time budget";
+    case Status::APPROXIMATE:
+      return "over budget, patch is approximate";
+  }
+  return "unknown status";
+}
+
+// Receives the records of a finished diff one at a time, in path order.
+class MoveSink {
+ public:
+  virtual ~MoveSink() = default;
+  virtual void write(const Move& move) = 0;
+};
+
+// Everything a diff call needs besides its input, the whole script while it
+// is built included. Keep one per thread and pass it to every call; what is
+// in it between calls is unspecified.
+struct DiffContext {
+  LineInterner interner;
+  std::vector<uint32_t> src, dst;
+  std::vector<Region> regions;
+  std::vector<Move> moves;
+  Scratch scratch;
+};
+
+// Diffs two sequences of interned lines, every id below `count`. Records go
+// to `sink` with no line text.
+inline Status diff(const uint32_t* src, size_t src_size, const uint32_t* dst,
+                   size_t dst_size, uint32_t count, const DiffOptions& options,
+                   DiffContext& context, MoveSink& sink) {
+  const size_t max = std::numeric_limits<int>::max();
+  if (src_size > max or dst_size > max) return Status::TOO_LARGE;
+  for (size_t i = 0; i < src_size; ++i) {
+    if (src[i] >= count) return Status::INVALID_ARGUMENT;
+  }
+  for (size_t j = 0; j < dst_size; ++j) {
+    if (dst[j] >= count) return Status::INVALID_ARGUMENT;
+  }
+
+  bool within;
+  try {
+    context.moves.clear();
+    within = diff_spans(LineSpan(src, src_size, 0), LineSpan(dst, dst_size, 0),
+                        count, options, context.scratch, context.regions,
+                        context.moves);
+  } catch (const std::bad_alloc&) {
+    return Status::OUT_OF_MEMORY;
+  } catch (const std::system_error&) {
+    return Status::SYSTEM_ERROR;
+  }
+  if (not within and not options.approximate) return Status::BUDGET_EXCEEDED;
+
+  for (const auto& move : context.moves) sink.write(move);
+  return within ? Status::OK : Status::APPROXIMATE;
+}
+
+// Diffs two sequences of lines. Every record goes to `sink` with its line,
+// a view into `src` (for REMOVE) or `dst` (for ADD).
+inline Status diff(const std::string_view* src, size_t src_size,
+                   const std::string_view* dst, size_t dst_size,
+                   const DiffOptions& options, DiffContext& context,
+                   MoveSink& sink) {
+  const size_t max = std::numeric_limits<int>::max();
+  if (src_size > max or dst_size > max) return Status::TOO_LARGE;
+
+  bool within;
+  try {
+    context.interner.clear();
+    context.src.resize(src_size);
+    context.dst.resize(dst_size);
+    for (size_t i = 0; i < src_size; ++i) {
+      context.src[i] = context.interner.intern(src[i]);
+    }
+    for (size_t j = 0; j < dst_size; ++j) {
+      context.dst[j] = context.interner.intern(dst[j]);
+    }
+
+    context.moves.clear();
+    within = diff_spans(context.src, context.dst, context.interner.count(),
+                        options, context.scratch, context.regions,
+                        context.moves);
+  } catch (const std::bad_alloc&) {
+    return Status::OUT_OF_MEMORY;
+  } catch (const std::system_error&) {
+    return Status::SYSTEM_ERROR;
+  }
+  if (not within and not options.approximate) return Status::BUDGET_EXCEEDED;
+
+  for (auto& move : context.moves) {
+    move.line = move.action == ADD ? dst[move.n] : src[move.n];
+    sink.write(move);
+  }
+  return within ? Status::OK : Status::APPROXIMATE;
+}
+
+// Bump allocator for line bytes. Copies are carved out of large blocks that
+// are only freed with the arena, so the views it hands out stay valid and
+// storing a line costs no allocation of its own.
+class Arena {
+ public:
+  std::string_view copy(std::string_view bytes) {
+    if (bytes.empty()) return std::string_view();
+    if (used + bytes.size() > capacity) {
+      capacity = std::max(BLOCK, bytes.size());
+      blocks.push_back(std::make_unique<char[]>(capacity));
+      used = 0;
+    }
+    char* data = blocks.back().get() + used;
+    memcpy(data, bytes.data(), bytes.size());
+    used += bytes.size();
+    return std::string_view(data, bytes.size());
+  }
+
+ private:
+  static constexpr size_t BLOCK = 1 << 20;
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  size_t used = 0, capacity = 0;
+};
+
+// Keeps the diff of a fixed base against a target that is edited a few lines
+// at a time. replace() only re-diffs a window of the edit path around the
+// replaced lines and keeps the path before and after it, so an edit costs
+// about the diff of that window rather than of the whole files. The result
+// is always a valid patch, though not always a shortest one.
+class IncrementalDiff {
+ public:
+  // All lines are copied, the caller's storage is not used after this.
+  IncrementalDiff(const std::string_view* base, size_t base_size,
+                  const std::string_view* target, size_t target_size,
+                  const DiffOptions& options = DiffOptions())
+      : options(options) {
+    for (size_t i = 0; i < base_size; ++i) {
+      src_lines.push_back(arena.copy(base[i]));
+      src.push_back(interner.intern(src_lines.back()));
+    }
+    for (size_t j = 0; j < target_size; ++j) {
+      dst_lines.push_back(arena.copy(target[j]));
+      dst.push_back(interner.intern(dst_lines.back()));
+    }
+
+    InternedLines lines = {src, dst, interner.count()};
+    moves = diff_lines(lines, options);
+  }
+
+  // Replaces target lines [first, first + count) with lines[0, size), false
+  // if that range is not in the target. The new lines are copied.
+  bool replace(int first, int count, const std::string_view* lines,
+               size_t size) {
+    if (first < 0 or count < 0 or first + count > (int)dst.size()) {
+      return false;
+    }
+    int last = first + count;
+    int delta = size - count;
+
+    // the window that is re-diffed, in old target lines
+    int begin = std::max(0, first - CONTEXT);
+    int end = std::min<int>(dst.size(), last + CONTEXT);
+
+    // Walks the edit path from (i, j) at move k: `diagonal` is the number of
+    // common lines before move k (or before the end of both files).
+    int i = 0, j = 0;
+    size_t k = 0;
+    auto diagonal = [&]() {
+      if (k == moves.size()) return int(src.size()) - i;
+      return moves[k].n - (moves[k].action == REMOVE ? i : j);
+    };
+    auto step = [&]() { (moves[k++].action == REMOVE ? i : j)++; };
+
+    // the earliest point with j == begin
+    while (j + diagonal() < begin) {
+      int d = diagonal();
+      i += d, j += d;
+      step();
+    }
+    int d = begin - j;
+    i += d, j += d;
+    size_t k_begin = k;
+    int i_begin = i, j_begin = j;
+
+    // the latest point with j == end
+    while (true) {
+      d = diagonal();
+      if (j + d > end or k == moves.size()) {
+        d = std::min(d, end - j);
+        i += d, j += d;
+        break;
+      }
+      i += d, j += d;
+      if (moves[k].action == ADD and j == end) break;
+      step();
+    }
+    size_t k_end = k;
+    int i_end = i;
+
+    // overwrite what can be, only a change in length moves the tail
+    int common = std::min<int>(count, size);
+    if (delta < 0) {
+      dst.erase(dst.begin() + first + common, dst.begin() + last);
+      dst_lines.erase(dst_lines.begin() + first + common,
+                      dst_lines.begin() + last);
+    } else if (delta > 0) {
+      dst.insert(dst.begin() + last, delta, 0);
+      dst_lines.insert(dst_lines.begin() + last, delta, std::string_view());
+    }
+    for (size_t t = 0; t < size; ++t) {
+      dst_lines[first + t] = arena.copy(lines[t]);
+      dst[first + t] = interner.intern(dst_lines[first + t]);
+    }
+
+    LineSpan src_span(src.data() + i_begin, i_end - i_begin, i_begin);
+    LineSpan dst_span(dst.data() + j_begin, end + delta - j_begin, j_begin);
+    trim_common(src_span, dst_span);
+    std::vector<Move> region;
+    if (src_span.size() > 0 or dst_span.size() > 0) {
+      // the window is small, so options.budget is not applied to it
+      options.engine(src_span, dst_span, region, scratch, Budget());
+    }
+
+    std::vector<Move> result(moves.begin(), moves.begin() + k_begin);
+    result.insert(result.end(), region.begin(), region.end());
+    for (k = k_end; k < moves.size(); ++k) {
+      result.push_back(moves[k]);
+      if (moves[k].action == ADD) result.back().n += delta;
+    }
+    moves = std::move(result);
+    return true;
+  }
+
+  // The current patch, in the order diff prints it.
+  const std::vector<Move>& patch() const { return moves; }
+
+  // The text of a record of patch().
+  std::string_view line(const Move& move) const {
+    return move.action == ADD ? dst_lines[move.n] : src_lines[move.n];
+  }
+
+ private:
+  // target lines re-diffed on either side of an edit, so that it can merge
+  // with the changes next to it
+  static const int CONTEXT = 16;
+
+  DiffOptions options;
+  Scratch scratch;
+  Arena arena;  // the bytes of every line ever seen, replaced ones too
+  std::vector<std::string_view> src_lines, dst_lines;
+  std::vector<uint32_t> src, dst;
+  LineInterner interner;
+  std::vector<Move> moves;
+};
+
+// Levenshtein distance between two byte strings, counting insertions,
+// deletions and substitutions, or max_distance + 1 as soon as it is known
+// to be larger. Strings whose shorter side fits in 64 bytes take Myers'
+// bit-vector algorithm on a single word; longer ones the DP a row at a time
+// in scratch.row, and only the band |i - j| <= max_distance of it.
+// Allocates nothing once scratch.row has grown to fit.
+inline int levenshtein(std::string_view a, std::string_view b,
+                       int max_distance, Scratch& scratch) {
+  while (not a.empty() and not b.empty() and a.front() == b.front()) {
+    a.remove_prefix(1), b.remove_prefix(1);
+  }
+  while (not a.empty() and not b.empty() and a.back() == b.back()) {
+    a.remove_suffix(1), b.remove_suffix(1);
+  }
+  if (a.size() < b.size()) std::swap(a, b);
+  int n = a.size();
+  int m = b.size();  // the shorter side
+  int k = std::min(std::max(max_distance, 0), n);
+  if (n - m > k) return k + 1;
+  if (m == 0) return n;
+
+  if (m <= 64) {
+    // bit i of the vertical deltas is D(i + 1, j) - D(i, j), b down the side
+    uint64_t equal[256] = {};
+    for (int i = 0; i < m; ++i) {
+      equal[(unsigned char)b[i]] |= uint64_t(1) << i;
+    }
+    uint64_t last = uint64_t(1) << (m - 1);
+    uint64_t plus = ~uint64_t(0), minus = 0;
+    int score = m;
+    for (int j = 0; j < n; ++j) {
+      uint64_t eq = equal[(unsigned char)a[j]];
+      uint64_t xv = eq | minus;
+      uint64_t xh = (((eq & plus) + plus) ^ plus) | eq;
+      uint64_t horizontal_plus = minus | ~(xh | plus);
+      uint64_t horizontal_minus = plus & xh;
+      if (horizontal_plus & last) {
+        score++;
+      } else if (horizontal_minus & last) {
+        score--;
+      }
+      // every column left can lower the score by at most one
+      if (score - (n - j - 1) > k) return k + 1;
+      horizontal_plus = (horizontal_plus << 1) | 1;
+      horizontal_minus <<= 1;
+      plus = horizontal_minus | ~(xv | horizontal_plus);
+      minus = horizontal_plus & xv;
+    }
+    return std::min(score, k + 1);
+  }
+
+  // row[j] is D(i, j), anything over k is kept as k + 1
+  auto& row = scratch.row;
+  row.resize(std::max<size_t>(row.size(), m + 1));
+  for (int j = 0; j <= m; ++j) row[j] = std::min(j, k + 1);
+  for (int i = 1; i <= n; ++i) {
+    int low = std::max(1, i - k), high = std::min(m, i + k);
+    int diagonal = row[low - 1];
+    row[low - 1] = low == 1 ? std::min(i, k + 1) : k + 1;
+    int best = row[low - 1];
+    for (int j = low; j <= high; ++j) {
+      int up = row[j];
+      int value = std::min({diagonal + (a[i - 1] != b[j - 1]), up + 1,
+                            row[j - 1] + 1, k + 1});
+      diagonal = up;
+      row[j] = value;
+      best = std::min(best, value);
+    }
+    if (best > k) return k + 1;
+  }
+  return row[m];
+}
+
+// One piece of an intra-line diff: text kept (IGNORE), removed or added.
+struct InlineEdit {
+  char action;
+  std::string_view text;
+};
+
+// Splits a line into words: runs of letters, digits and '_', runs of
+// whitespace, and single bytes of anything else.
+inline void split_words(std::string_view line,
+                        std::vector<std::string_view>& words) {
+  auto kind = [](unsigned char c) {
+    if (std::isalnum(c) or c == '_') return 1;
+    return std::isspace(c) ? 2 : 0;
+  };
+  words.clear();
+  for (size_t begin = 0, end; begin < line.size(); begin = end) {
+    int first = kind(line[begin]);
+    end = begin + 1;
+    while (first != 0 and end < line.size() and kind(line[end]) == first) {
+      end++;
+    }
+    words.push_back(line.substr(begin, end - begin));
+  }
+}
+
+// Diffs a pair of lines word by word, with myers_linear_diff so a long line
+// only costs O(n) memory. The buffers are kept between calls.
+class WordDiff {
+ public:
+  // The edits turning `src` into `dst`, as views into both. Between two
+  // kept pieces every removed word comes first as one edit, then every
+  // added one. Valid until the next call.
+  const std::vector<InlineEdit>& diff(std::string_view src,
+                                      std::string_view dst) {
+    split_words(src, src_words);
+    split_words(dst, dst_words);
+    interner.clear();
+    src_ids.resize(src_words.size());
+    dst_ids.resize(dst_words.size());
+    for (size_t i = 0; i < src_words.size(); ++i) {
+      src_ids[i] = interner.intern(src_words[i]);
+    }
+    for (size_t j = 0; j < dst_words.size(); ++j) {
+      dst_ids[j] = interner.intern(dst_words[j]);
+    }
+    moves.clear();
+    myers_linear_diff(src_ids, dst_ids, moves, scratch, Budget());
+
+    // the words of [begin, end) are contiguous in their line
+    auto text = [](const std::vector<std::string_view>& words, int begin,
+                   int end) {
+      if (begin == end) return std::string_view();
+      const char* first = words[begin].data();
+      return std::string_view(first, words[end - 1].data() +
+                                         words[end - 1].size() - first);
+    };
+    edits.clear();
+    int i = 0, j = 0;              // words consumed
+    int block_i = 0, block_j = 0;  // where the current change began
+    auto keep = [&](int count) {
+      if (count == 0) return;
+      if (i > block_i) edits.push_back({REMOVE, text(src_words, block_i, i)});
+      if (j > block_j) edits.push_back({ADD, text(dst_words, block_j, j)});
+      edits.push_back({IGNORE, text(src_words, i, i + count)});
+      i += count, j += count;
+      block_i = i, block_j = j;
+    };
+    for (const auto& move : moves) {
+      keep(move.n - (move.action == REMOVE ? i : j));
+      (move.action == REMOVE ? i : j)++;
+    }
+    keep(src_words.size() - i);
+    if (i > block_i) edits.push_back({REMOVE, text(src_words, block_i, i)});
+    if (j > block_j) edits.push_back({ADD, text(dst_words, block_j, j)});
+    return edits;
+  }
+
+ private:
+  LineInterner interner;
+  std::vector<std::string_view> src_words, dst_words;
+  std::vector<uint32_t> src_ids, dst_ids;
+  std::vector<Move> moves;
+  Scratch scratch;
+  std::vector<InlineEdit> edits;
+};
+
+}  // namespace cdiff
+
+#endif  // LIBCDIFF_H